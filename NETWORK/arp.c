@@ -32,48 +32,6 @@
 #include "NETWORK/ip.h"
 #include "main.h"
 
-// Determines whether packet is ARP - Request
-bool etherIsArpRequest(etherHeader *ether)
-{
-    uint8_t ipAddress[IP_ADD_LENGTH];
-    etherGetIpAddress(ipAddress);
-
-    arpPacket *arp = (arpPacket*)ether->data;
-    bool ok;
-    uint8_t i = 0;
-    ok = (ether->frameType == htons(0x0806));
-    while (ok & (i < IP_ADD_LENGTH))
-    {
-        ok = (arp->destIp[i] == ipAddress[i]);
-        i++;
-    }
-    if (ok)
-        ok = (arp->op == htons(1));
-    return ok;
-}
-
-// Determines whether packet is ARP - Response
-bool etherIsArpResponse(etherHeader *ether)
-{
-    uint8_t ipAddress[IP_ADD_LENGTH];
-    etherGetIpAddress(ipAddress);
-
-    arpPacket *arp = (arpPacket*)ether->data;
-    bool ok;
-    uint8_t i = 0;
-    ok = (ether->frameType == htons(0x0806));
-    while (ok & (i < IP_ADD_LENGTH))
-    {
-        ok = (arp->destIp[i] == ipAddress[i]);
-        i++;
-    }
-    if (ok)
-        ok = (arp->op == htons(2));
-    return ok;
-}
-
-//=====================================================================================================
-
 // Sends an ARP response given the request data
 void etherSendArpResponse(etherHeader *ether)
 {
@@ -147,4 +105,26 @@ uint8_t * etherParseArpResponse(etherHeader *ether)
     return arp->sourceAddress;
 }
 
+//=====================================================================================================
+
+// Programs the controller to accept only ARP frames that target this IP, plus unicast to this MAC
+// Pattern window starts at the frame type, so it covers the type (offset 12) and the target IP (offset 38)
+// Call again whenever the IP address changes
+void etherSetArpPatternFilter()
+{
+    uint8_t ipAddress[IP_ADD_LENGTH];
+    uint8_t pattern[64] = {0};
+    uint8_t mask[8] = {0};
+    uint8_t i;
+    etherGetIpAddress(ipAddress);
 
+    pattern[0] = 0x08;
+    pattern[1] = 0x06;
+    mask[0] = 0x03;
+    for (i = 0; i < IP_ADD_LENGTH; i++)
+        pattern[26 + i] = ipAddress[i];
+    mask[3] = 0x3C;
+
+    etherSetPatternMatch(12, pattern, mask);
+    etherSetReceiveFilter(ETHER_UNICAST | ETHER_PATTERNMATCH);
+}
@@ -44,13 +44,12 @@ typedef struct _arpPacket       // 28 bytes
   uint8_t destIp[4];
 } arpPacket;
 
-bool etherIsArpRequest(etherHeader *ether);
-bool etherIsArpResponse(etherHeader *ether);
-
 void etherSendArpResponse(etherHeader *ether);
 void etherSendArpRequest(etherHeader *ether, uint8_t ip[]);
 
 uint8_t* etherParseArpResponse(etherHeader *ether);
 
+void etherSetArpPatternFilter(void);
+
 
 #endif
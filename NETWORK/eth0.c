@@ -15,7 +15,7 @@
 //   MOSI (SSI0Tx) on PA5
 //   MISO (SSI0Rx) on PA4
 //   SCLK (SSI0Clk) on PA2
-//   ~CS (SW controlled) on PA3
+//   ~CS on PA3 (SW controlled, or SSI0Fss for register accesses with ETHER_CS_FSS)
 //   WOL on PB3
 //   INT on PC6
 
@@ -36,6 +36,19 @@
 #define CS PORTA,3
 #define WOL PORTB,3
 #define INT PORTC,6
+#define INT_MASK 64
+
+// Bit-band aliases of the CS data and alternate function select bits
+#define CS_DATA  (*((volatile uint32_t*)PORTA + 3))
+#define CS_AFSEL (*((volatile uint32_t*)PORTA + 3 + 9*4*8))
+
+// SPI opcodes
+#define RCR 0x00
+#define WCR 0x40
+#define BFS 0x80
+#define BFC 0xA0
+#define RBM 0x3A
+#define WBM 0x7A
 
 // Ether registers
 #define ERDPTL      0x00
@@ -55,10 +68,16 @@
 #define ERXWRPTL    0x0E
 #define ERXWRPTH    0x0F
 #define EIE         0x1B
+#define RXERIE  0x01
+#define TXIE    0x08
+#define LINKIE  0x10
+#define PKTIE   0x40
+#define INTIE   0x80
 #define EIR         0x1C
 #define RXERIF  0x01
 #define TXERIF  0x02
 #define TXIF    0x08
+#define LINKIF  0x10
 #define PKTIF   0x40
 #define ESTAT       0x1D
 #define CLKRDY  0x01
@@ -68,6 +87,12 @@
 #define ECON1       0x1F
 #define RXEN    0x04
 #define TXRTS   0x08
+#define EHT0        0x20
+#define EPMM0       0x28
+#define EPMCSL      0x30
+#define EPMCSH      0x31
+#define EPMOL       0x34
+#define EPMOH       0x35
 #define ERXFCON     0x38
 #define EPKTCNT     0x39
 #define MACON1      0x40
@@ -105,6 +130,11 @@
 #define MISTAT      0x6A
 #define MIBUSY  0x01
 #define ECOCON      0x75
+#define EFLOCON     0x77
+#define FCEN_OFF        0x00
+#define FCEN_ONCE       0x01
+#define FCEN_PERIODIC   0x02
+#define FCEN_ZERO       0x03
 
 // Ether phy registers
 #define PHCON1      0x00
@@ -113,12 +143,39 @@
 #define LSTAT  0x0400
 #define PHCON2      0x10
 #define HDLDIS 0x0100
+#define PHSTAT2     0x11
+#define PHIE        0x12
+#define PGEIE  0x0002
+#define PLNKIE 0x0010
+#define PHIR        0x13
 #define PHLCON      0x14
 
 // Packets
 #define IP_ADD_LENGTH 4
 #define HW_ADD_LENGTH 6
 
+// Buffer memory map
+// Receive ring at the bottom of the 8K space, ETHER_TX_SLOTS transmit slots at the top
+// Each slot holds the control byte, a 1518 byte frame, and the 7 byte tx status vector
+#define ETHER_TX_SLOTS      2
+#define ETHER_TX_SLOT_SIZE  0x0600
+#define ETHER_TX_START      (0x2000 - ETHER_TX_SLOTS * ETHER_TX_SLOT_SIZE)
+#define ETHER_RX_START      0x0000
+#define ETHER_RX_END        (ETHER_TX_START - 1)
+
+// SPI clock scaling
+// The ENC28J60 is rated to 20 MHz, candidate rates are 40 MHz over even divisors
+#define ETHER_SPI_FCYC          40000000
+#define ETHER_SPI_MIN           4000000
+#define ETHER_SPI_MAX           20000000
+#define ETHER_SPI_TEST_SIZE     64
+
+// Rx ring flow control thresholds in bytes
+// Pause frames start above the high mark and stop once the ring drains below the low mark
+#define ETHER_RX_SIZE           (ETHER_RX_END - ETHER_RX_START + 1)
+#define ETHER_RX_HIGH_MARK      (ETHER_RX_SIZE * 3 / 4)
+#define ETHER_RX_LOW_MARK       (ETHER_RX_SIZE / 4)
+
 //=====================================================================================================
 //  Globals
 //=====================================================================================================
@@ -132,6 +189,42 @@ uint8_t ipSubnetMask[IP_ADD_LENGTH] = {255,255,255,0};
 uint8_t ipGwAddress[IP_ADD_LENGTH] = {0,0,0,0};
 bool    dhcpEnabled = true;
 
+// Bank currently selected in ECON1, 0xFF until the first switch
+uint8_t currentBank = 0xFF;
+
+// Interrupt state
+// The isr only flags that INT fired, EIR is read from the main loop
+volatile bool intPending = true;
+uint8_t etherEvents = 0;
+
+// Transmit slots
+// Slots are filled and sent in order, txSlotCount includes the slot on the wire
+uint16_t txSlotSize[ETHER_TX_SLOTS];
+uint8_t txSlotWrite = 0;
+uint8_t txSlotSend = 0;
+uint8_t txSlotCount = 0;
+bool txBusy = false;
+uint16_t txAbortCount = 0;
+
+// Link status, updated from the phy link change interrupt
+bool linkUp = false;
+
+// SPI clock in use and the ceiling for scaling, 0 selects ETHER_SPI_MAX
+uint32_t spiRate = ETHER_SPI_MIN;
+uint32_t spiRateLimit = 0;
+
+// Register accesses are one 16-bit frame framed by SSI0Fss when set
+bool csHardware = false;
+
+// Rx ring accounting
+uint16_t rxReadPtr = ETHER_RX_START;        // start of the oldest unread frame
+uint16_t rxOccupancy = 0;
+uint16_t rxHighWater = 0;
+uint16_t rxOverflowCount = 0;
+bool    fullDuplex = false;
+bool    flowControl = false;
+bool    rxPaused = false;
+
 //=====================================================================================================
 // Subroutines
 //=====================================================================================================
@@ -141,7 +234,7 @@ void etherBuildEtherHeader(etherHeader *ether, uint8_t *dest_addr, uint16_t fram
     uint8_t i = 0;
     for (i = 0; i < HW_ADD_LENGTH; i++)
     {
-        ether->sourceAddress[i] = ipAddress[i];
+        ether->sourceAddress[i] = macAddress[i];
         ether->destAddress[i] = dest_addr[i];
     }
 
@@ -150,69 +243,99 @@ void etherBuildEtherHeader(etherHeader *ether, uint8_t *dest_addr, uint16_t fram
 
 
 // Buffer is configured as follows
-// Receive buffer starts at 0x0000 (bottom 6666 bytes of 8K space)
-// Transmit buffer at 01A0A (top 1526 bytes of 8K space)
+// Receive buffer starts at ETHER_RX_START (bottom of 8K space)
+// Transmit slots start at ETHER_TX_START (top ETHER_TX_SLOTS * 1536 bytes of 8K space)
+// CS is written through its bit-band alias
+// With hardware CS the pin is taken back from SSI0Fss for buffer memory bursts,
+// since Fss pulses high between frames in mode 0,0 and would end the burst
 void etherCsOn()
 {
-    setPinValue(CS, 0);
-    _delay_cycles(4);                    // allow line to settle
+    if (csHardware)
+    {
+        setSpi0DataSize(8);
+        CS_DATA = 0;
+        CS_AFSEL = 0;
+    }
+    else
+        CS_DATA = 0;
+    _delay_cycles(2);                    // allow line to settle
 }
 
 void etherCsOff()
 {
-    setPinValue(CS, 1);
+    CS_DATA = 1;
+    if (csHardware)
+    {
+        CS_AFSEL = 1;
+        setSpi0DataSize(16);
+    }
 }
 
-//=====================================================================================================
-
-void etherWriteReg(uint8_t reg, uint8_t data)
+// Sends an opcode and its data byte as one burst and returns the byte clocked in with the data
+// With hardware CS this is a single 16-bit frame, otherwise both bytes are queued before
+// waiting so the bus never idles inside the transaction
+uint8_t etherTransaction(uint8_t opcode, uint8_t data)
 {
+    uint8_t rx;
+    if (csHardware)
+    {
+        writeSpi0Data((opcode << 8) | data);
+        return readSpi0Data() & 0xFF;
+    }
     etherCsOn();
-    writeSpi0Data(0x40 | (reg & 0x1F));
-    readSpi0Data();
+    SSI0_DR_R = opcode;
     writeSpi0Data(data);
     readSpi0Data();
+    rx = readSpi0Data();
     etherCsOff();
+    return rx;
+}
+
+//=====================================================================================================
+
+void etherWriteReg(uint8_t reg, uint8_t data)
+{
+    etherTransaction(WCR | (reg & 0x1F), data);
 }
 
 uint8_t etherReadReg(uint8_t reg)
 {
-    uint8_t data;
-    etherCsOn();
-    writeSpi0Data(0x00 | (reg & 0x1F));
-    readSpi0Data();
-    writeSpi0Data(0);
-    data = readSpi0Data();
-    etherCsOff();
-    return data;
+    return etherTransaction(RCR | (reg & 0x1F), 0);
 }
 
 void etherSetReg(uint8_t reg, uint8_t mask)
 {
-    etherCsOn();
-    writeSpi0Data(0x80 | (reg & 0x1F));
-    readSpi0Data();
-    writeSpi0Data(mask);
-    readSpi0Data();
-    etherCsOff();
+    etherTransaction(BFS | (reg & 0x1F), mask);
 }
 
 void etherClearReg(uint8_t reg, uint8_t mask)
 {
-    etherCsOn();
-    writeSpi0Data(0xA0 | (reg & 0x1F));
-    readSpi0Data();
-    writeSpi0Data(mask);
-    readSpi0Data();
-    etherCsOff();
+    etherTransaction(BFC | (reg & 0x1F), mask);
 }
 
 //=====================================================================================================
 
+// Selects the bank holding reg, skipping the switch if it is already selected
+// Common registers (EIE through ECON1) are mapped in every bank
+// Only the BSEL bits that differ are cleared or set
 void etherSetBank(uint8_t reg)
 {
-    etherClearReg(ECON1, 0x03);
-    etherSetReg(ECON1, reg >> 5);
+    uint8_t bank = (reg >> 5) & 0x03;
+    if ((reg & 0x1F) >= EIE || bank == currentBank)
+        return;
+    if (currentBank > 0x03)
+    {
+        etherClearReg(ECON1, 0x03);
+        etherSetReg(ECON1, bank);
+    }
+    else
+    {
+        if ((currentBank & ~bank) != 0)
+            etherClearReg(ECON1, currentBank & ~bank);
+        if ((bank & ~currentBank) != 0)
+            etherSetReg(ECON1, bank & ~currentBank);
+    }
+    currentBank = bank;
 }
 
 void etherWritePhy(uint8_t reg, uint16_t data)
@@ -223,6 +346,7 @@ void etherWritePhy(uint8_t reg, uint16_t data)
     etherWriteReg(MIWRH, (data >> 8) & 0xFF);
 }
 
+// MIREGADR, MICMD, and MIRD are in bank 2, only MISTAT needs a switch to bank 3
 uint16_t etherReadPhy(uint8_t reg)
 {
     uint16_t data, dataH;
@@ -242,10 +366,89 @@ uint16_t etherReadPhy(uint8_t reg)
 
 //=====================================================================================================
 
+// Sets the highest SPI clock etherScaleSpiRate may select, call before etherInit
+// 0 restores the controller maximum
+void etherSetSpiRateLimit(uint32_t rate)
+{
+    spiRateLimit = rate;
+}
+
+uint32_t etherGetSpiRate()
+{
+    return spiRate;
+}
+
+// Writes test patterns to a register and to the first tx slot and checks they read back
+// Only safe before transmission is enabled, the slot contents are overwritten
+bool etherTestSpi()
+{
+    const uint8_t patterns[] = {0x55, 0xAA, 0x00, 0xFF, 0x0F, 0xF0};
+    uint8_t out[ETHER_SPI_TEST_SIZE];
+    uint8_t in[ETHER_SPI_TEST_SIZE];
+    uint8_t i;
+
+    etherSetBank(EWRPTL);
+    for (i = 0; i < sizeof(patterns); i++)
+    {
+        etherWriteReg(EWRPTL, patterns[i]);
+        if (etherReadReg(EWRPTL) != patterns[i])
+            return false;
+    }
+
+    // walking ones followed by a pseudo-random fill
+    for (i = 0; i < ETHER_SPI_TEST_SIZE; i++)
+        out[i] = (i < 8) ? (1 << i) : (i * 151 + 29);
+
+    etherWriteReg(EWRPTL, LOBYTE(ETHER_TX_START));
+    etherWriteReg(EWRPTH, HIBYTE(ETHER_TX_START));
+    etherWriteMemStart();
+    etherWriteMemBlock(out, ETHER_SPI_TEST_SIZE);
+    etherWriteMemStop();
+
+    etherWriteReg(ERDPTL, LOBYTE(ETHER_TX_START));
+    etherWriteReg(ERDPTH, HIBYTE(ETHER_TX_START));
+    etherReadMemStart();
+    etherReadMemBlock(in, ETHER_SPI_TEST_SIZE);
+    etherReadMemStop();
+
+    for (i = 0; i < ETHER_SPI_TEST_SIZE; i++)
+        if (in[i] != out[i])
+            return false;
+    return true;
+}
+
+// Steps the SPI clock up through the even divisors of the system clock and settles
+// on the fastest rate that passes etherTestSpi, falling back to the last good rate
+void etherScaleSpiRate()
+{
+    uint32_t limit = spiRateLimit;
+    uint32_t divisor;
+    uint32_t rate;
+
+    if (limit == 0 || limit > ETHER_SPI_MAX)
+        limit = ETHER_SPI_MAX;
+
+    spiRate = ETHER_SPI_MIN;
+    setSpi0BaudRate(spiRate, ETHER_SPI_FCYC);
+    for (divisor = ETHER_SPI_FCYC / ETHER_SPI_MIN - 2; divisor >= 2; divisor -= 2)
+    {
+        rate = ETHER_SPI_FCYC / divisor;
+        if (rate > limit)
+            break;
+        setSpi0BaudRate(rate, ETHER_SPI_FCYC);
+        if (!etherTestSpi())
+            break;
+        spiRate = rate;
+    }
+    setSpi0BaudRate(spiRate, ETHER_SPI_FCYC);
+}
+
+//=====================================================================================================
+
 void etherWriteMemStart()
 {
     etherCsOn();
-    writeSpi0Data(0x7A);
+    writeSpi0Data(WBM);
     readSpi0Data();
 }
 
@@ -263,7 +466,7 @@ void etherWriteMemStop()
 void etherReadMemStart()
 {
     etherCsOn();
-    writeSpi0Data(0x3A);
+    writeSpi0Data(RBM);
     readSpi0Data();
 }
 
@@ -273,6 +476,18 @@ uint8_t etherReadMem()
     return readSpi0Data();
 }
 
+// Burst transfers to and from buffer memory
+// Must be bracketed by etherReadMemStart/Stop or etherWriteMemStart/Stop
+void etherWriteMemBlock(const uint8_t *data, uint16_t size)
+{
+    writeSpi0Block(data, size);
+}
+
+void etherReadMemBlock(uint8_t *data, uint16_t size)
+{
+    readSpi0Block(data, size);
+}
+
 void etherReadMemStop()
 {
     etherCsOff();
@@ -285,9 +500,20 @@ void etherReadMemStop()
 void etherInit(uint16_t mode)
 {
     // Initialize SPI0
-    initSpi0(USE_SSI0_RX);
-    setSpi0BaudRate(4e6, 40e6);
+    csHardware = (mode & ETHER_CS_FSS) != 0;
+    if (csHardware)
+        initSpi0(USE_SSI0_RX | USE_SSI0_FSS);
+    else
+        initSpi0(USE_SSI0_RX);
+    spiRate = ETHER_SPI_MIN;
+    setSpi0BaudRate(spiRate, ETHER_SPI_FCYC);
     setSpi0Mode(0, 0);
+    if (csHardware)
+        setSpi0DataSize(16);
+    fullDuplex = (mode & ETHER_FULLDUPLEX) != 0;
+    flowControl = (mode & ETHER_FLOWCONTROL) != 0;
+    rxReadPtr = ETHER_RX_START;
+    rxPaused = false;
 
     // Enable clocks
     enablePort(PORTA);
@@ -295,37 +521,45 @@ void etherInit(uint16_t mode)
     enablePort(PORTC);
 
     // Configure pins for ethernet module
+    // CS idles high whether driven by software or by SSI0Fss
+    CS_DATA = 1;
     selectPinPushPullOutput(CS);
     selectPinDigitalInput(WOL);
     selectPinDigitalInput(INT);
+    selectPinInterruptFallingEdge(INT);
 
     // make sure that oscillator start-up timer has expired
     while ((etherReadReg(ESTAT) & CLKRDY) == 0) {}
 
+    // bank is unknown until selected
+    currentBank = 0xFF;
+
+    // run the rest of bring-up at the fastest rate that passes read-back
+    etherScaleSpiRate();
+
     // disable transmission and reception of packets
     etherClearReg(ECON1, RXEN);
     etherClearReg(ECON1, TXRTS);
 
     // initialize receive buffer space
     etherSetBank(ERXSTL);
-    etherWriteReg(ERXSTL, LOBYTE(0x0000));
-    etherWriteReg(ERXSTH, HIBYTE(0x0000));
-    etherWriteReg(ERXNDL, LOBYTE(0x1A09));
-    etherWriteReg(ERXNDH, HIBYTE(0x1A09));
+    etherWriteReg(ERXSTL, LOBYTE(ETHER_RX_START));
+    etherWriteReg(ERXSTH, HIBYTE(ETHER_RX_START));
+    etherWriteReg(ERXNDL, LOBYTE(ETHER_RX_END));
+    etherWriteReg(ERXNDH, HIBYTE(ETHER_RX_END));
    
     // initialize receiver write and read ptrs
-    // at startup, will write from 0 to 1A08 only and will not overwrite rd ptr
-    etherWriteReg(ERXWRPTL, LOBYTE(0x0000));
-    etherWriteReg(ERXWRPTH, HIBYTE(0x0000));
-    etherWriteReg(ERXRDPTL, LOBYTE(0x1A09));
-    etherWriteReg(ERXRDPTH, HIBYTE(0x1A09));
-    etherWriteReg(ERDPTL, LOBYTE(0x0000));
-    etherWriteReg(ERDPTH, HIBYTE(0x0000));
+    // at startup, will write from start to end-1 only and will not overwrite rd ptr
+    etherWriteReg(ERXWRPTL, LOBYTE(ETHER_RX_START));
+    etherWriteReg(ERXWRPTH, HIBYTE(ETHER_RX_START));
+    etherWriteReg(ERXRDPTL, LOBYTE(ETHER_RX_END));
+    etherWriteReg(ERXRDPTH, HIBYTE(ETHER_RX_END));
+    etherWriteReg(ERDPTL, LOBYTE(ETHER_RX_START));
+    etherWriteReg(ERDPTH, HIBYTE(ETHER_RX_START));
 
     // setup receive filter
     // always check CRC, use OR mode
-    etherSetBank(ERXFCON);
-    etherWriteReg(ERXFCON, (mode | ETHER_CHECKCRC) & 0xFF);
+    etherSetReceiveFilter(mode & 0xFF);
 
     // bring mac out of reset
     etherSetBank(MACON2);
@@ -359,15 +593,7 @@ void etherInit(uint16_t mode)
 
     // leave collision window MACLCON2 as reset
 
-    // setup mac address
-    etherSetBank(MAADR0);
-    etherWriteReg(MAADR5, macAddress[0]);
-    etherWriteReg(MAADR4, macAddress[1]);
-    etherWriteReg(MAADR3, macAddress[2]);
-    etherWriteReg(MAADR2, macAddress[3]);
-    etherWriteReg(MAADR1, macAddress[4]);
-    etherWriteReg(MAADR0, macAddress[5]);
-
+    // phy registers are written through bank 2, so do them before leaving it
     // initialize phy duplex
     if ((mode & ETHER_FULLDUPLEX) != 0)
         etherWritePhy(PHCON1, PDPXMD);
@@ -385,34 +611,251 @@ void etherInit(uint16_t mode)
     // stretch LED on to 40ms (default)
     etherWritePhy(PHLCON, 0x0472);
 
+    // interrupt on link change, reading PHIR acknowledges it
+    etherWritePhy(PHIE, PGEIE | PLNKIE);
+    etherReadPhy(PHIR);
+    linkUp = (etherReadPhy(PHSTAT2) & LSTAT) != 0;
+
+    // setup mac address
+    etherSetBank(MAADR0);
+    etherWriteReg(MAADR5, macAddress[0]);
+    etherWriteReg(MAADR4, macAddress[1]);
+    etherWriteReg(MAADR3, macAddress[2]);
+    etherWriteReg(MAADR2, macAddress[3]);
+    etherWriteReg(MAADR1, macAddress[4]);
+    etherWriteReg(MAADR0, macAddress[5]);
+
+    // enable interrupts on INT for rx, rx error, tx done, and link change
+    etherWriteReg(EIE, INTIE | PKTIE | RXERIE | TXIE | LINKIE);
+    GPIO_PORTC_ICR_R = INT_MASK;
+    enablePinInterrupt(INT);
+    NVIC_EN0_R |= 1 << (INT_GPIOC-16);
+
     // enable reception
     etherSetReg(ECON1, RXEN);
 }
 
 //=====================================================================================================
 
+// INT is active low, flag pending work for the main loop
+void etherIsr()
+{
+    GPIO_PORTC_ICR_R = INT_MASK;
+    intPending = true;
+}
+
+// Latches EIR into etherEvents when the controller has asserted INT
+// INT stays low while any enabled flag is set, so the pin is also checked
+// in case an event arrived while another was still pending
+void etherServiceInterrupts()
+{
+    uint8_t flags;
+    if (!intPending && getPinValue(INT))
+        return;
+    intPending = false;
+    flags = etherReadReg(EIR);
+
+    // PKTIF tracks the packet count, other flags are latched until consumed
+    etherEvents = (etherEvents & ~PKTIF) | flags;
+
+    // acknowledge latched events so that INT can deassert
+    if ((flags & (TXIF | RXERIF)) != 0)
+        etherClearReg(EIR, flags & (TXIF | RXERIF));
+
+    // LINKIF is read only, it clears when PHIR is read
+    if ((flags & LINKIF) != 0)
+    {
+        etherReadPhy(PHIR);
+        linkUp = (etherReadPhy(PHSTAT2) & LSTAT) != 0;
+    }
+
+    etherServiceTx();
+}
+
+//=====================================================================================================
+
+// Selects which frames the controller accepts, CRC checking is always on
+// filter is a combination of the ETHER_ filter bits (unicast, broadcast, hash table, ...)
+void etherSetReceiveFilter(uint8_t filter)
+{
+    etherSetBank(ERXFCON);
+    etherWriteReg(ERXFCON, filter | ETHER_CHECKCRC);
+}
+
+// Clears all hash table entries
+void etherClearHashTable()
+{
+    uint8_t i;
+    etherSetBank(EHT0);
+    for (i = 0; i < 8; i++)
+        etherWriteReg(EHT0 + i, 0);
+}
+
+// Sets the hash table bit for a destination address
+// The controller uses bits 28:23 of the CRC-32 of the address as the bit index
+// Other addresses can share the bit, so software must still check the destination
+void etherAddHashTableEntry(uint8_t mac[6])
+{
+    uint32_t crc = 0xFFFFFFFF;
+    uint8_t i, j, data;
+    bool bit;
+    for (i = 0; i < HW_ADD_LENGTH; i++)
+    {
+        data = mac[i];
+        for (j = 0; j < 8; j++)
+        {
+            bit = ((crc >> 31) ^ data) & 1;
+            crc <<= 1;
+            if (bit)
+                crc ^= 0x04C11DB7;
+            data >>= 1;
+        }
+    }
+    etherSetBank(EHT0);
+    etherSetReg(EHT0 + ((crc >> 26) & 0x07), 1 << ((crc >> 23) & 0x07));
+}
+
+// Adds the hash table entry for an IPv4 multicast group
+// Group address maps to 01:00:5E followed by its low 23 bits
+void etherJoinMulticastGroup(uint8_t ip[4])
+{
+    uint8_t mac[HW_ADD_LENGTH] = {0x01, 0x00, 0x5E, 0, 0, 0};
+    mac[3] = ip[1] & 0x7F;
+    mac[4] = ip[2];
+    mac[5] = ip[3];
+    etherAddHashTableEntry(mac);
+}
+
+// Programs the pattern match filter
+// offset is the (even) frame offset of a 64 byte window, bit n of mask selects byte n
+// of the window, and pattern holds the expected window contents
+void etherSetPatternMatch(uint16_t offset, uint8_t pattern[64], uint8_t mask[8])
+{
+    uint8_t selected[64];
+    uint8_t i, count = 0;
+    uint16_t check;
+    uint32_t sum = 0;
+
+    // checksum over the selected bytes as if they were contiguous
+    for (i = 0; i < 64; i++)
+        if ((mask[i >> 3] & (1 << (i & 7))) != 0)
+            selected[count++] = pattern[i];
+    etherSumWords(selected, count, &sum);
+    check = getEtherChecksum(sum);
+
+    etherSetBank(EPMM0);
+    for (i = 0; i < 8; i++)
+        etherWriteReg(EPMM0 + i, mask[i]);
+
+    // EPMCSH holds the first byte of the checksum on the wire
+    etherWriteReg(EPMCSL, HIBYTE(check));
+    etherWriteReg(EPMCSH, LOBYTE(check));
+    etherWriteReg(EPMOL, LOBYTE(offset));
+    etherWriteReg(EPMOH, HIBYTE(offset));
+}
+
+//=====================================================================================================
+
 // Returns true if link is up
+// Returns the link status cached by the link change interrupt
 bool etherIsLinkUp()
 {
-    return (etherReadPhy(PHSTAT1) & LSTAT) != 0;
+    etherServiceInterrupts();
+    return linkUp;
+}
+
+// Returns true once after each link change, read etherIsLinkUp for the new state
+bool etherIsLinkChanged()
+{
+    bool changed;
+    etherServiceInterrupts();
+    changed = (etherEvents & LINKIF) != 0;
+    etherEvents &= ~LINKIF;
+    return changed;
 }
 
 // Returns TRUE if packet received
 bool etherIsDataAvailable()
 {
-    return ((etherReadReg(EIR) & PKTIF) != 0);
+    etherServiceInterrupts();
+    return ((etherEvents & PKTIF) != 0);
+}
+
+// Returns the number of received packets waiting in the rx ring
+// Also samples ring occupancy, so call once per receive wakeup
+uint8_t etherGetPacketCount()
+{
+    etherUpdateRxOccupancy();
+    etherSetBank(EPKTCNT);
+    return etherReadReg(EPKTCNT);
 }
 
 // Returns true if rx buffer overflowed after correcting the problem
 bool etherIsOverflow()
 {
     bool err;
-    err = (etherReadReg(EIR) & RXERIF) != 0;
+    etherServiceInterrupts();
+    err = (etherEvents & RXERIF) != 0;
+    etherEvents &= ~RXERIF;
     if (err)
-        etherClearReg(EIR, RXERIF);
+        rxOverflowCount++;
     return err;
 }
 
+// Measures bytes waiting in the rx ring from the hardware write pointer
+// and our read pointer, tracks the high-water mark, and applies flow control
+void etherUpdateRxOccupancy()
+{
+    uint16_t writePtr;
+    etherSetBank(ERXWRPTL);
+    writePtr = etherReadReg(ERXWRPTL);
+    writePtr |= etherReadReg(ERXWRPTH) << 8;
+    if (writePtr >= rxReadPtr)
+        rxOccupancy = writePtr - rxReadPtr;
+    else
+        rxOccupancy = ETHER_RX_SIZE - (rxReadPtr - writePtr);
+    if (rxOccupancy > rxHighWater)
+        rxHighWater = rxOccupancy;
+
+    if (!flowControl)
+        return;
+
+    // full duplex sends 802.3x pause frames, half duplex uses backpressure
+    if (!rxPaused && rxOccupancy > ETHER_RX_HIGH_MARK)
+    {
+        etherSetBank(EFLOCON);
+        etherWriteReg(EFLOCON, fullDuplex ? FCEN_PERIODIC : FCEN_ONCE);
+        rxPaused = true;
+    }
+    else if (rxPaused && rxOccupancy < ETHER_RX_LOW_MARK)
+    {
+        etherSetBank(EFLOCON);
+        etherWriteReg(EFLOCON, fullDuplex ? FCEN_ZERO : FCEN_OFF);
+        rxPaused = false;
+    }
+}
+
+// Rx ring statistics
+uint16_t etherGetRxSize()
+{
+    return ETHER_RX_SIZE;
+}
+
+uint16_t etherGetRxOccupancy()
+{
+    return rxOccupancy;
+}
+
+uint16_t etherGetRxHighWater()
+{
+    return rxHighWater;
+}
+
+uint16_t etherGetRxOverflowCount()
+{
+    return rxOverflowCount;
+}
+
 //=====================================================================================================
 
 // Returns up to max_size characters in data buffer
@@ -420,94 +863,230 @@ bool etherIsOverflow()
 // Contents written are 16-bit size, 16-bit status, payload excl crc
 uint16_t etherGetPacket(etherHeader *ether, uint16_t maxSize)
 {
-    uint16_t i = 0, size, tmp16, status;
+    uint16_t size;
     uint8_t *packet = (uint8_t*)ether;
 
     // enable read from FIFO buffers
     etherReadMemStart();
 
-    // get next packet information
-    nextPacketLsb = etherReadMem();
-    nextPacketMsb = etherReadMem();
-
-    // calc size
-    // don't return crc, instead return size + status, so size is correct
-    size = etherReadMem();
-    tmp16 = etherReadMem();
-    size |= (tmp16 << 8);
-
-    // get status (currently unused)
-    status = etherReadMem();
-    tmp16 = etherReadMem();
-    status |= (tmp16 << 8);
+    size = etherReadRxHeader();
 
     // copy data
     if (size > maxSize)
         size = maxSize;
-    while (i < size)
-        packet[i++] = etherReadMem();
+    etherReadMemBlock(packet, size);
 
     // end read from FIFO buffers
     etherReadMemStop();
 
+    etherReleasePacket();
+
+    return size;
+}
+
+// Reads the next packet pointer, size, and status in one burst
+// Must follow etherReadMemStart, returns the size
+uint16_t etherReadRxHeader()
+{
+    uint8_t header[6];
+    uint16_t size;
+
+    etherReadMemBlock(header, 6);
+    nextPacketLsb = header[0];
+    nextPacketMsb = header[1];
+
+    // calc size
+    // don't return crc, instead return size + status, so size is correct
+    size = header[2] | (header[3] << 8);
+
+    // status is header[4..5] (currently unused)
+
+    return size;
+}
+
+// Frees the current packet in the rx ring
+void etherReleasePacket()
+{
     // advance read pointer
     etherSetBank(ERXRDPTL);
     etherWriteReg(ERXRDPTL, nextPacketLsb); // hw ptr
     etherWriteReg(ERXRDPTH, nextPacketMsb);
+    rxReadPtr = nextPacketLsb | (nextPacketMsb << 8);
     etherWriteReg(ERDPTL, nextPacketLsb);   // dma rd ptr
     etherWriteReg(ERDPTH, nextPacketMsb);
 
     // decrement packet counter so that PKTIF is maintained correctly
     etherSetReg(ECON2, PKTDEC);
+    etherEvents &= ~PKTIF;
 
-    return size;
+    // while paused no wakeup may come, so release pressure as soon as the ring drains
+    if (rxPaused)
+        etherUpdateRxOccupancy();
 }
 
-// Writes a packet
-bool etherPutPacket(etherHeader *ether, uint16_t size)
+// Returns true while flow control is holding off the sender
+bool etherIsRxPaused()
 {
-    uint16_t i;
-    uint8_t *packet = (uint8_t*) ether;
+    return rxPaused;
+}
 
-    // clear out any tx errors
-    if ((etherReadReg(EIR) & TXERIF) != 0)
+// Reads the headers of the next packet and only copies the rest if the classifier wants it
+// Up to ETHER_PEEK_SIZE bytes are read first, then the read pointer is left in place
+// while isWanted runs, so an unwanted frame is dropped by just advancing ERXRDPT
+// Returns number of bytes copied to buffer, 0 if the frame was dropped
+uint16_t etherGetPacketFiltered(etherHeader *ether, uint16_t maxSize, bool (*isWanted)(etherHeader *ether, uint16_t size))
+{
+    uint16_t size, peek;
+    uint8_t *packet = (uint8_t*)ether;
+
+    etherReadMemStart();
+    size = etherReadRxHeader();
+    if (size > maxSize)
+        size = maxSize;
+    peek = size;
+    if (peek > ETHER_PEEK_SIZE)
+        peek = ETHER_PEEK_SIZE;
+    etherReadMemBlock(packet, peek);
+    etherReadMemStop();
+
+    if (!isWanted(ether, size))
     {
-        etherClearReg(EIR, TXERIF);
-        etherSetReg(ECON1, TXRTS);
-        etherClearReg(ECON1, TXRTS);
+        etherReleasePacket();
+        return 0;
+    }
+
+    // ERDPT continues from the end of the peeked headers
+    if (size > peek)
+    {
+        etherReadMemStart();
+        etherReadMemBlock(packet + peek, size - peek);
+        etherReadMemStop();
     }
 
+    etherReleasePacket();
+
+    return size;
+}
+
+// Prepares the next free tx slot and starts a buffer memory write
+// Caller must check that a slot is free, writes the frame body, then calls etherEndTxWrite
+void etherBeginTxWrite()
+{
+    uint16_t start = ETHER_TX_START + txSlotWrite * ETHER_TX_SLOT_SIZE;
+
     // set DMA start address
     etherSetBank(EWRPTL);
-    etherWriteReg(EWRPTL, LOBYTE(0x1A0A));
-    etherWriteReg(EWRPTH, HIBYTE(0x1A0A));
+    etherWriteReg(EWRPTL, LOBYTE(start));
+    etherWriteReg(EWRPTH, HIBYTE(start));
 
     // start FIFO buffer write
     etherWriteMemStart();
 
     // write control byte
     etherWriteMem(0);
+}
 
-    // write data
-    for (i = 0; i < size; i++)
-        etherWriteMem(packet[i]);
-
+// Ends the buffer memory write and queues the slot for transmission
+void etherEndTxWrite(uint16_t size)
+{
     // stop write
     etherWriteMemStop();
-  
+
+    txSlotSize[txSlotWrite] = size;
+    txSlotWrite = (txSlotWrite + 1) % ETHER_TX_SLOTS;
+    txSlotCount++;
+
+    if (!txBusy)
+        etherStartTx();
+}
+
+// Requests transmission of the oldest filled slot
+// Completion is reported through TXIF, see etherServiceTx
+void etherStartTx()
+{
+    uint16_t start = ETHER_TX_START + txSlotSend * ETHER_TX_SLOT_SIZE;
+
+    // clear out any tx errors
+    if ((etherReadReg(EIR) & TXERIF) != 0)
+    {
+        etherClearReg(EIR, TXERIF);
+        etherSetReg(ECON1, TXRTS);
+        etherClearReg(ECON1, TXRTS);
+    }
+
     // request transmit
-    etherWriteReg(ETXSTL, LOBYTE(0x1A0A));
-    etherWriteReg(ETXSTH, HIBYTE(0x1A0A));
-    etherWriteReg(ETXNDL, LOBYTE(0x1A0A+size));
-    etherWriteReg(ETXNDH, HIBYTE(0x1A0A+size));
+    etherSetBank(ETXSTL);
+    etherWriteReg(ETXSTL, LOBYTE(start));
+    etherWriteReg(ETXSTH, HIBYTE(start));
+    etherWriteReg(ETXNDL, LOBYTE(start + txSlotSize[txSlotSend]));
+    etherWriteReg(ETXNDH, HIBYTE(start + txSlotSize[txSlotSend]));
     etherClearReg(EIR, TXIF);
+    etherEvents &= ~TXIF;
+    txBusy = true;
     etherSetReg(ECON1, TXRTS);
+}
 
-    // wait for completion
-    while ((etherReadReg(ECON1) & TXRTS) != 0);
+// Retires the frame on the wire and starts the next filled slot
+// Called from etherServiceInterrupts after EIR has been latched
+void etherServiceTx()
+{
+    if (txBusy && (etherEvents & TXIF) != 0)
+    {
+        etherEvents &= ~TXIF;
+        txBusy = false;
+        if ((etherReadReg(ESTAT) & TXABORT) != 0)
+            txAbortCount++;
+        txSlotSend = (txSlotSend + 1) % ETHER_TX_SLOTS;
+        txSlotCount--;
+    }
+    if (!txBusy && txSlotCount > 0)
+        etherStartTx();
+}
 
-    // determine success
-    return ((etherReadReg(ESTAT) & TXABORT) == 0);
+// Writes a packet
+// The frame is copied into a free tx slot while earlier frames may still be on the wire
+// Blocks only if all slots are in use
+// Returns false only if the frame does not fit a slot or the link is down
+// A frame the controller aborts is not reported here, see etherGetTxAbortCount
+bool etherPutPacket(etherHeader *ether, uint16_t size)
+{
+    uint8_t *packet = (uint8_t*) ether;
+
+    if (size > ETHER_TX_SLOT_SIZE - 8)
+        return false;
+
+    // nothing to send on, don't let frames pile up in the slots
+    if (!linkUp)
+        return false;
+
+    // wait for a free slot
+    etherServiceInterrupts();
+    while (txSlotCount == ETHER_TX_SLOTS)
+        etherServiceInterrupts();
+
+    etherBeginTxWrite();
+    etherWriteMemBlock(packet, size);
+    etherEndTxWrite(size);
+    return true;
+}
+
+// Returns true when no frame is queued or on the wire
+bool etherIsTxIdle()
+{
+    etherServiceInterrupts();
+    return txSlotCount == 0;
+}
+
+// Waits until all queued frames have been sent
+void etherFlushTx()
+{
+    while (!etherIsTxIdle());
+}
+
+// Returns the number of frames aborted by the controller
+uint16_t etherGetTxAbortCount()
+{
+    return txAbortCount;
 }
 
 //=====================================================================================================
@@ -628,24 +1207,105 @@ void etherGetMacAddress(uint8_t mac[6])
 
 // Calculate sum of words
 // Must use getEtherChecksum to complete 1's compliment addition
+// Bytes are summed as little-endian 16-bit lanes starting from the first byte of data
+// Aligned 32-bit words are added into a 64-bit accumulator (ADDS/ADC pairs on the M4),
+// 32 bytes per pass, and the result is folded to 16 bits before adding to sum
+// If data starts on an odd address the words are summed one byte out of lane and the
+// folded result is byte swapped to compensate (rfc1071 byte order independence)
 void etherSumWords(void* data, uint16_t sizeInBytes, uint32_t* sum)
 {
     uint8_t* pData = (uint8_t*)data;
-    uint16_t i;
-    uint8_t phase = 0;
-    uint16_t data_temp;
-    for (i = 0; i < sizeInBytes; i++)
+    const uint32_t* pWord;
+    uint64_t acc = 0;
+    uint32_t folded;
+    bool odd = false;
+
+    if (sizeInBytes == 0)
+        return;
+
+    // align to a halfword, the first byte lands in the high lane of what follows
+    if (((uint32_t)pData & 1) != 0)
     {
-        if (phase)
-        {
-            data_temp = *pData;
-            *sum += data_temp << 8;
-        }
-        else
-          *sum += *pData;
-        phase = 1 - phase;
+        acc = (uint32_t)*pData << 8;
         pData++;
+        sizeInBytes--;
+        odd = true;
+    }
+
+    // align to a word
+    if (((uint32_t)pData & 2) != 0 && sizeInBytes >= 2)
+    {
+        acc += *(uint16_t*)pData;
+        pData += 2;
+        sizeInBytes -= 2;
+    }
+
+    pWord = (const uint32_t*)pData;
+    while (sizeInBytes >= 32)
+    {
+        acc += pWord[0];
+        acc += pWord[1];
+        acc += pWord[2];
+        acc += pWord[3];
+        acc += pWord[4];
+        acc += pWord[5];
+        acc += pWord[6];
+        acc += pWord[7];
+        pWord += 8;
+        sizeInBytes -= 32;
+    }
+    while (sizeInBytes >= 4)
+    {
+        acc += *pWord++;
+        sizeInBytes -= 4;
     }
+
+    pData = (uint8_t*)pWord;
+    if (sizeInBytes >= 2)
+    {
+        acc += *(uint16_t*)pData;
+        pData += 2;
+        sizeInBytes -= 2;
+    }
+    if (sizeInBytes != 0)
+        acc += *pData;
+
+    // fold 64 to 16 bits with end-around carries
+    acc = (acc & 0xFFFFFFFF) + (acc >> 32);
+    acc = (acc & 0xFFFFFFFF) + (acc >> 32);
+    folded = (uint32_t)acc;
+    folded = (folded & 0xFFFF) + (folded >> 16);
+    folded = (folded & 0xFFFF) + (folded >> 16);
+
+    if (odd)
+        folded = ((folded & 0xFF) << 8) | (folded >> 8);
+    *sum += folded;
+}
+
+// Copies size bytes from src to dest, adding them to sum in the same lanes as etherSumWords
+// offset is the position of dest within the checksummed block and selects the lane of the
+// first byte, so a block can be summed in pieces as it is built
+// dest may equal src to sum bytes already in place
+void etherCopySumWords(void* dest, const void* src, uint16_t size, uint16_t offset, uint32_t* sum)
+{
+    uint8_t* pDest = (uint8_t*)dest;
+    const uint8_t* pSrc = (const uint8_t*)src;
+    uint32_t low = 0, high = 0;
+
+    if ((offset & 1) != 0 && size != 0)
+    {
+        high += *pDest++ = *pSrc++;
+        size--;
+    }
+    while (size >= 2)
+    {
+        low += *pDest++ = *pSrc++;
+        high += *pDest++ = *pSrc++;
+        size -= 2;
+    }
+    if (size != 0)
+        low += *pDest = *pSrc;
+    *sum += low + (high << 8);
 }
 
 // Completes 1's compliment addition by folding carries back into field
@@ -659,6 +1319,16 @@ uint16_t getEtherChecksum(uint32_t sum)
     return ~result;
 }
 
+// Updates a checksum for one 16-bit word changing from oldWord to newWord (rfc1624 eqn 3)
+// Words are in the same lane order as etherSumWords, i.e. as read from the frame
+uint16_t etherAdjustChecksum(uint16_t check, uint16_t oldWord, uint16_t newWord)
+{
+    uint32_t sum = (uint16_t)~check;
+    sum += (uint16_t)~oldWord;
+    sum += newWord;
+    return getEtherChecksum(sum);
+}
+
 //=====================================================================================================
 
 // Converts from host to network order and vice versa
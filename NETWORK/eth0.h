@@ -80,10 +80,18 @@ typedef struct _dhcpFrame       // 240 or more bytes
 #define ETHER_MAGICPACKET    0x08
 #define ETHER_PATTERNMATCH   0x10
 #define ETHER_CHECKCRC       0x20
+#define ETHER_ANDFILTER      0x40
 
 #define ETHER_HALFDUPLEX     0x00
 #define ETHER_FULLDUPLEX     0x100
 
+#define ETHER_FLOWCONTROL    0x200
+#define ETHER_CS_FSS         0x400
+
+// Bytes read ahead for etherGetPacketFiltered
+// Covers ethernet (14) + ip (20) + tcp (20) headers, enough for arp, icmp, and udp
+#define ETHER_PEEK_SIZE      54
+
 #define LOBYTE(x) ((x) & 0xFF)
 #define HIBYTE(x) (((x) >> 8) & 0xFF)
 
@@ -94,6 +102,12 @@ typedef struct _dhcpFrame       // 240 or more bytes
 void etherBuildEtherHeader(etherHeader *ether, uint8_t *dest_addr, uint16_t frameType);
 void etherCsOn(void);
 void etherCsOff(void);
+uint8_t etherTransaction(uint8_t opcode, uint8_t data);
+
+void etherSetSpiRateLimit(uint32_t rate);
+uint32_t etherGetSpiRate(void);
+bool etherTestSpi(void);
+void etherScaleSpiRate(void);
 
 void etherWriteReg(uint8_t reg, uint8_t data);
 uint8_t etherReadReg(uint8_t reg);
@@ -110,15 +124,43 @@ void etherWriteMemStop(void);
 void etherReadMemStart(void);
 uint8_t etherReadMem(void);
 void etherReadMemStop(void);
+void etherWriteMemBlock(const uint8_t *data, uint16_t size);
+void etherReadMemBlock(uint8_t *data, uint16_t size);
 
 void etherInit(uint16_t mode);
+void etherIsr(void);
+void etherServiceInterrupts(void);
+
+void etherSetReceiveFilter(uint8_t filter);
+void etherClearHashTable(void);
+void etherAddHashTableEntry(uint8_t mac[6]);
+void etherJoinMulticastGroup(uint8_t ip[4]);
+void etherSetPatternMatch(uint16_t offset, uint8_t pattern[64], uint8_t mask[8]);
 
 bool etherIsLinkUp(void);
+bool etherIsLinkChanged(void);
 bool etherIsDataAvailable(void);
 bool etherIsOverflow(void);
+uint8_t etherGetPacketCount(void);
+void etherUpdateRxOccupancy(void);
+bool etherIsRxPaused(void);
+uint16_t etherGetRxSize(void);
+uint16_t etherGetRxOccupancy(void);
+uint16_t etherGetRxHighWater(void);
+uint16_t etherGetRxOverflowCount(void);
 
 uint16_t etherGetPacket(etherHeader *ether, uint16_t maxSize);
+uint16_t etherReadRxHeader(void);
+void etherReleasePacket(void);
+uint16_t etherGetPacketFiltered(etherHeader *ether, uint16_t maxSize, bool (*isWanted)(etherHeader *ether, uint16_t size));
 bool etherPutPacket(etherHeader *ether, uint16_t size);
+void etherBeginTxWrite(void);
+void etherEndTxWrite(uint16_t size);
+void etherStartTx(void);
+void etherServiceTx(void);
+bool etherIsTxIdle(void);
+void etherFlushTx(void);
+uint16_t etherGetTxAbortCount(void);
 
 uint16_t etherGetId(void);
 void etherIncId(void);
@@ -141,7 +183,9 @@ void etherSetMacAddress(uint8_t mac0, uint8_t mac1, uint8_t mac2, uint8_t mac3,
 void etherGetMacAddress(uint8_t mac[6]);
 
 void etherSumWords(void* data, uint16_t sizeInBytes, uint32_t* sum);
+void etherCopySumWords(void* dest, const void* src, uint16_t size, uint16_t offset, uint32_t* sum);
 uint16_t getEtherChecksum(uint32_t sum);
+uint16_t etherAdjustChecksum(uint16_t check, uint16_t oldWord, uint16_t newWord);
 
 uint16_t htons(uint16_t value);
 uint32_t htonl(uint32_t value);
@@ -11,17 +11,6 @@
 #include <stdlib.h>
 #include "main.h"
 
-
-// Determines whether packet is ping request
-// Must be an IP packet
-bool etherIsPingRequest(etherHeader *ether)
-{
-    ipHeader *ip = (ipHeader*)ether->data;
-    uint8_t ipHeaderLength = (ip->revSize & 0xF) * 4;
-    icmpHeader *icmp = (icmpHeader*)((uint8_t*)ip + ipHeaderLength);
-    return (ip->protocol == 0x01 & icmp->type == 8);
-}
-
 // Sends a ping response given the request data
 void etherSendPingResponse(etherHeader *ether)
 {
@@ -29,9 +18,9 @@ void etherSendPingResponse(etherHeader *ether)
     uint8_t ipHeaderLength = (ip->revSize & 0xF) * 4;
     icmpHeader *icmp = (icmpHeader*)((uint8_t*)ip + ipHeaderLength);
     uint8_t i, tmp;
-    uint16_t icmp_size;
-    uint32_t sum = 0;
+    uint16_t oldWord;
     // swap source and destination fields
+    // swapping leaves the ip and icmp sums unchanged, so neither needs a full pass
     for (i = 0; i < HW_ADD_LENGTH; i++)
     {
         tmp = ether->destAddress[i];
@@ -44,13 +33,10 @@ void etherSendPingResponse(etherHeader *ether)
         ip->destIp[i] = ip ->sourceIp[i];
         ip->sourceIp[i] = tmp;
     }
-    // this is a response
+    // this is a response, adjust the icmp checksum for the type byte only
+    oldWord = icmp->type | (icmp->code << 8);
     icmp->type = 0;
-    // calc icmp checksum
-    icmp->check = 0;
-    icmp_size = ntohs(ip->length) - ipHeaderLength;
-    etherSumWords(icmp, icmp_size, &sum);
-    icmp->check = getEtherChecksum(sum);
+    icmp->check = etherAdjustChecksum(icmp->check, oldWord, icmp->type | (icmp->code << 8));
     // send packet
     etherPutPacket(ether, sizeof(etherHeader) + ntohs(ip->length));
 }
@@ -23,7 +23,6 @@ typedef struct _icmpHeader      // 8 bytes
   uint8_t data[0];
 } icmpHeader;
 
-bool etherIsPingRequest(etherHeader *ether);
 void etherSendPingResponse(etherHeader *ether);
 
 
@@ -35,6 +35,12 @@
 uint16_t id = 0;
 
 
+// Returns the identification for the next datagram
+uint16_t etherNextIpId()
+{
+    return id++;
+}
+
 void etherBuildIpHeader(etherHeader *ether, uint16_t dataLength, uint8_t *dest_ip)
 {
 
@@ -46,7 +52,7 @@ void etherBuildIpHeader(etherHeader *ether, uint16_t dataLength, uint8_t *dest_i
        ip->revSize = 0x40 | (IP_HEADER_LENGTH / 4);
        ip->typeOfService = 0x0;
        ip->length = htons(IP_HEADER_LENGTH + dataLength);
-       ip->id = htons(id);
+       ip->id = htons(etherNextIpId());
        ip->flagsAndOffset = htons(0x4000);
        ip->ttl = IP_TTL;
        ip->protocol = 0x06;
@@ -63,22 +69,6 @@ void etherBuildIpHeader(etherHeader *ether, uint16_t dataLength, uint8_t *dest_i
 
 //=====================================================================================================
 
-// Determines whether packet is IP datagram
-bool etherIsIp(etherHeader *ether)
-{
-    ipHeader *ip = (ipHeader*)ether->data;
-    uint8_t ipHeaderLength = (ip->revSize & 0xF) * 4;
-    uint32_t sum = 0;
-    bool ok;
-    ok = (ether->frameType == htons(0x0800));
-    if (ok)
-    {
-        etherSumWords(&ip->revSize, ipHeaderLength, &sum);
-        ok = (getEtherChecksum(sum) == 0);
-    }
-    return ok;
-}
-
 // Determines whether packet is unicast to this ip
 // Must be an IP packet
 bool etherIsIpUnicast(etherHeader *ether)
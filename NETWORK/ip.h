@@ -53,9 +53,9 @@ typedef struct _ipHeader        // 20 or more bytes
 #define IP_HEADER_LENGTH 20
 #define IP_TTL 64
 
+uint16_t etherNextIpId(void);
 void etherBuildIpHeader(etherHeader *ether, uint16_t dataLength, uint8_t *dest_ip);
 
-bool etherIsIp(etherHeader *ether);
 bool etherIsIpUnicast(etherHeader *ether);
 
 void etherCalcIpChecksum(etherHeader *ether);
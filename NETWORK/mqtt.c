@@ -35,6 +35,9 @@ uint16_t mqttID = 1;
 
 bool connected = false;
 
+// Bytes of an oversized received packet still to be dropped from the stream
+uint32_t mqttSkip = 0;
+
 char mqttClientID[MAX_MQTT_ID];
 
 uint8_t mqtt_dest_addr[HW_ADD_LENGTH] = {2,3,4,5,6,7};
@@ -52,12 +55,13 @@ void mqttSendConnect(etherHeader *ether, uint8_t *local_dest_addr, uint8_t *loca
     for (i = 0; i < MAX_MQTT_ID && ID[i] != '\0'; i++)
         mqttClientID[i] = ID[i];
 
+    mqttSkip = 0;
     etherOpenTCPConnection(ether, local_dest_addr, local_dest_ip, MQTT_PORT);
 }
 
 void mqttSendConnectReturn(etherHeader *ether)
 {
-    uint8_t i = 0;
+    uint32_t sum = 0;
 
     uint16_t ClientNameLength = 0;
 
@@ -66,9 +70,7 @@ void mqttSendConnectReturn(etherHeader *ether)
 
     uint16_t MQTTLength = 0x02 + 0x0C + ClientNameLength;
 
-    etherBuildEtherHeader(ether, mqtt_dest_addr, 0x0800);
-    etherBuildIpHeader(ether, TCP_HEADER_LENGTH + MQTTLength, mqtt_dest_ip);
-    etherBuildTcpHeader(ether, PSH_ACK);
+    etherBuildTcpHeaders(ether, PSH_ACK, MQTTLength);
 
     ipHeader *ip = (ipHeader*)ether->data;
     uint8_t ipHeaderLength = (ip->revSize & 0xF) * 4;
@@ -89,14 +91,12 @@ void mqttSendConnectReturn(etherHeader *ether)
     mqttConnect->keepAlive = htons(0xFFFF);
 
     mqttConnect->clientIDLength = htons(ClientNameLength);
-    for (i = 0; i < ClientNameLength; i++)
-        mqttConnect->clientID[i] = mqttClientID[i];
+    etherSumWords(mqttConnect, 0x0E, &sum);
+    etherCopySumWords(mqttConnect->clientID, mqttClientID, ClientNameLength, 0x0E, &sum);
 
-    etherCalcTcpChecksum(ether);
+    etherCalcTcpChecksumPartial(ether, sum);
 
-    etherPutPacket(ether, sizeof(etherHeader) + IP_HEADER_LENGTH + TCP_HEADER_LENGTH + MQTTLength);
-
-    etherIncrementSeq(MQTTLength);
+    etherTcpSend(ether, MQTTLength);
 
 }
 
@@ -120,14 +120,71 @@ bool MQTTisPacket(etherHeader *ether)
     return true;
 }
 
-uint8_t MQTTgetPacketLength(etherHeader *ether)
+// Takes every complete control packet waiting in the tcp receive stream and handles it
+// A packet may arrive split across segments or several to a segment, partial ones are
+// left in the stream for the next call
+void mqttHandleStream()
 {
-    ipHeader *ip = (ipHeader*)ether->data;
-    uint8_t ipHeaderLength = (ip->revSize & 0xF) * 4;
-    tcpHeader *tcp = (tcpHeader*)((uint8_t*)ip + ipHeaderLength);
-    MQTTConnectFrame *mqttConnect = (MQTTConnectFrame*)tcp->data;
+    uint8_t packet[MQTT_MAX_PACKET_SIZE];
+    uint16_t available;
+    uint32_t remainingLength, multiplier;
+    uint8_t headerLength, byte;
+
+    while (true)
+    {
+        // finish skipping an oversized packet
+        if (mqttSkip > 0)
+        {
+            mqttSkip -= etherTcpStreamRead(NULL, mqttSkip > 0xFFFF ? 0xFFFF : mqttSkip);
+            if (mqttSkip > 0)
+                return;
+        }
+
+        available = etherTcpStreamAvailable();
+
+        // fixed header is the type byte and a 1 to 4 byte remaining length
+        remainingLength = 0;
+        multiplier = 1;
+        headerLength = 1;
+        do
+        {
+            if (headerLength >= available)
+                return;
+            byte = etherTcpStreamPeek(headerLength++);
+            remainingLength += (byte & 0x7F) * multiplier;
+            multiplier *= 128;
+        } while ((byte & 0x80) && headerLength < 5);
+
+        if (headerLength + remainingLength > MQTT_MAX_PACKET_SIZE)
+        {
+            mqttSkip = headerLength + remainingLength;
+            continue;
+        }
+        if (available < headerLength + remainingLength)
+            return;
 
-    return mqttConnect->remainingLength + 0x2;
+        etherTcpStreamRead(packet, headerLength + remainingLength);
+        mqttHandlePacket(packet, headerLength, headerLength + remainingLength);
+    }
+}
+
+// Hands a complete control packet to its handler by type
+void mqttHandlePacket(uint8_t *packet, uint8_t headerLength, uint16_t length)
+{
+    switch (packet[0] & 0xF0)
+    {
+    case CONNACK:
+        MQTThandleConnect(packet);
+        break;
+    case PINGRESP:
+        MQTThandlePingResponse(packet);
+        break;
+    case PUBLISH:
+        mqttHandlePublish(packet, headerLength, length);
+        break;
+    default:
+        break;
+    }
 }
 
 //=====================================================================================================
@@ -138,10 +195,9 @@ void mqttSendDisconnect(etherHeader *ether)
         return;
 
     uint16_t MQTTLength = 0x02; //2bytes
+    uint32_t sum = 0;
 
-    etherBuildEtherHeader(ether, mqtt_dest_addr, 0x0800);
-    etherBuildIpHeader(ether, TCP_HEADER_LENGTH + MQTTLength, mqtt_dest_ip);
-    etherBuildTcpHeader(ether, PSH_ACK);
+    etherBuildTcpHeaders(ether, PSH_ACK, MQTTLength);
 
     ipHeader *ip = (ipHeader*)ether->data;
     uint8_t ipHeaderLength = (ip->revSize & 0xF) * 4;
@@ -150,10 +206,10 @@ void mqttSendDisconnect(etherHeader *ether)
 
     mqttDisconnect->typeFlags = DISCONNECT | 0x0;
     mqttDisconnect->remainingLength = MQTTLength - 0x02;
+    etherSumWords(mqttDisconnect, MQTTLength, &sum);
 
-    etherCalcTcpChecksum(ether);
-    etherPutPacket(ether, sizeof(etherHeader) + IP_HEADER_LENGTH + TCP_HEADER_LENGTH + MQTTLength);
-    etherIncrementSeq(MQTTLength);
+    etherCalcTcpChecksumPartial(ether, sum);
+    etherTcpSend(ether, MQTTLength);
 
     connected = false;
 
@@ -161,13 +217,13 @@ void mqttSendDisconnect(etherHeader *ether)
 
 //=====================================================================================================
 
-void mqttSendPublish(etherHeader *ether, char *topic, char *data)
+bool mqttSendPublish(etherHeader *ether, char *topic, char *data)
 {
 
     if (mqttID == 0)
         mqttID = 1;
 
-    uint8_t i = 0;
+    uint32_t sum = 0;
 
     uint16_t TopicLength = 0;
 
@@ -181,9 +237,7 @@ void mqttSendPublish(etherHeader *ether, char *topic, char *data)
 
     uint16_t MQTTLength = 0x02 + 0x04 + TopicLength + (DataLength + 0x02);
 
-    etherBuildEtherHeader(ether, mqtt_dest_addr, 0x0800);
-    etherBuildIpHeader(ether, TCP_HEADER_LENGTH + MQTTLength, mqtt_dest_ip);
-    etherBuildTcpHeader(ether, PSH_ACK);
+    etherBuildTcpHeaders(ether, PSH_ACK, MQTTLength);
 
     ipHeader *ip = (ipHeader*)ether->data;
     uint8_t ipHeaderLength = (ip->revSize & 0xF) * 4;
@@ -196,56 +250,76 @@ void mqttSendPublish(etherHeader *ether, char *topic, char *data)
     mqttPublishP1->remainingLength = MQTTLength - 0x02;
 
     mqttPublishP1->topicLength = htons(TopicLength);
-    for (i = 0; i < TopicLength; i++)
-        mqttPublishP1->topic[i] = topic[i];
+    etherSumWords(mqttPublishP1, 0x04, &sum);
+    etherCopySumWords(mqttPublishP1->topic, topic, TopicLength, 0x04, &sum);
 
     mqttPublishP2->ID = htons(mqttID);
 
     mqttString->length = htons(DataLength);
-    for (i = 0; i < DataLength; i++)
-        mqttString->string[i] = data[i];
+    etherCopySumWords(mqttPublishP2, mqttPublishP2, 0x04, 0x04 + TopicLength, &sum);
+    etherCopySumWords(mqttString->string, data, DataLength, 0x08 + TopicLength, &sum);
 
-    etherCalcTcpChecksum(ether);
-    etherPutPacket(ether, sizeof(etherHeader) + IP_HEADER_LENGTH + TCP_HEADER_LENGTH + MQTTLength);
-    etherIncrementSeq(MQTTLength);
+    etherCalcTcpChecksumPartial(ether, sum);
+    if (!etherTcpSend(ether, MQTTLength))
+        return false;
 
     mqttID++;
+
+    return true;
 }
 
-void mqttHandlePublish(etherHeader *ether)
+// Prints a received publish, packet is the whole control packet
+// Topic and data are cut to what fits in the packet and the print buffers
+void mqttHandlePublish(uint8_t *packet, uint8_t headerLength, uint16_t length)
 {
-    ipHeader *ip = (ipHeader*)ether->data;
-    uint8_t ipHeaderLength = (ip->revSize & 0xF) * 4;
-    tcpHeader *tcp = (tcpHeader*)((uint8_t*)ip + ipHeaderLength);
-    MQTTPublishRecFrame *mqttPublishRec = (MQTTPublishRecFrame*)tcp->data;
+    uint8_t *end = packet + length;
+    uint8_t *field = packet + headerLength;
 
-    if ((mqttPublishRec->typeFlags & 0xF0) != PUBLISH)
+    if ((packet[0] & 0xF0) != PUBLISH || field + 2 > end)
         return;
 
-    uint16_t topicLength = ntohs(mqttPublishRec->topicLength);
-
-    MQTTString *mqttString = (MQTTString*)((uint8_t*)mqttPublishRec + (0x04 + topicLength));
+    uint16_t topicLength = (field[0] << 8) | field[1];
+    field += 2;
+    if (topicLength > end - field)
+        return;
 
     char topic[MAX_TOPIC_LENGTH];
     char data[MAX_DATA_LENGTH];
-    uint8_t i = 0;
+    uint16_t dataLength = 0;
+    uint16_t i = 0;
 
-    for (i = 0; i < ntohs(mqttPublishRec->topicLength); i++)
-        topic[i] = mqttPublishRec->topic[i];
-    topic[ntohs(mqttPublishRec->topicLength)] = '\0';
+    for (i = 0; i < topicLength && i < MAX_TOPIC_LENGTH - 1; i++)
+        topic[i] = field[i];
+    topic[i] = '\0';
+    field += topicLength;
 
-    for (i = 0; i < ntohs(mqttString->length); i++)
-        data[i] = mqttString->string[i];
-    data[ntohs(mqttString->length)] = '\0';
+    // qos 1 and 2 carry a packet id after the topic
+    if (packet[0] & 0x06)
+        field += 2;
+
+    // data carries its own length, as this client publishes it
+    if (field + 2 <= end)
+    {
+        dataLength = (field[0] << 8) | field[1];
+        field += 2;
+        if (dataLength > end - field)
+            dataLength = end - field;
+        if (dataLength > MAX_DATA_LENGTH - 1)
+            dataLength = MAX_DATA_LENGTH - 1;
+    }
+
+    for (i = 0; i < dataLength; i++)
+        data[i] = field[i];
+    data[dataLength] = '\0';
 
     printPublish(topic, data);
 }
 
 //=====================================================================================================
 
-void mqttSendSubscribe(etherHeader *ether, char *topic)
+bool mqttSendSubscribe(etherHeader *ether, char *topic)
 {
-    uint8_t i = 0;
+    uint32_t sum = 0;
 
     uint16_t TopicLength = 0;
 
@@ -253,9 +327,7 @@ void mqttSendSubscribe(etherHeader *ether, char *topic)
         TopicLength++;
 
     uint16_t MQTTLength = 0x02 + 0x05 + TopicLength;
-    etherBuildEtherHeader(ether, mqtt_dest_addr, 0x0800);
-    etherBuildIpHeader(ether, TCP_HEADER_LENGTH + MQTTLength, mqtt_dest_ip);
-    etherBuildTcpHeader(ether, PSH_ACK);
+    etherBuildTcpHeaders(ether, PSH_ACK, MQTTLength);
 
     ipHeader *ip = (ipHeader*)ether->data;
     uint8_t ipHeaderLength = (ip->revSize & 0xF) * 4;
@@ -269,22 +341,25 @@ void mqttSendSubscribe(etherHeader *ether, char *topic)
     mqttSubscribeP1-> ID = htons(mqttID);
 
     mqttSubscribeP1->topicLength = htons(TopicLength);
-    for (i = 0; i < TopicLength; i++)
-        mqttSubscribeP1->topic[i] = topic[i];
+    etherSumWords(mqttSubscribeP1, 0x06, &sum);
+    etherCopySumWords(mqttSubscribeP1->topic, topic, TopicLength, 0x06, &sum);
 
+    // only the first byte of QOS is part of the packet
     mqttSubscribeP2->QOS = 0x00;
+    etherCopySumWords(mqttSubscribeP2, mqttSubscribeP2, 0x01, 0x06 + TopicLength, &sum);
 
-    etherCalcTcpChecksum(ether);
-    etherPutPacket(ether, sizeof(etherHeader) + IP_HEADER_LENGTH + TCP_HEADER_LENGTH + MQTTLength);
-    etherIncrementSeq(MQTTLength);
+    etherCalcTcpChecksumPartial(ether, sum);
+    if (!etherTcpSend(ether, MQTTLength))
+        return false;
 
     mqttID++;
 
+    return true;
 }
 
-void mqttSendUnsubscribe(etherHeader *ether, char *topic)
+bool mqttSendUnsubscribe(etherHeader *ether, char *topic)
 {
-    uint8_t i = 0;
+    uint32_t sum = 0;
 
     uint16_t TopicLength = 0;
 
@@ -292,9 +367,7 @@ void mqttSendUnsubscribe(etherHeader *ether, char *topic)
         TopicLength++;
 
     uint16_t MQTTLength = 0x02 + 0x04 + TopicLength;
-    etherBuildEtherHeader(ether, mqtt_dest_addr, 0x0800);
-    etherBuildIpHeader(ether, TCP_HEADER_LENGTH + MQTTLength, mqtt_dest_ip);
-    etherBuildTcpHeader(ether, PSH_ACK);
+    etherBuildTcpHeaders(ether, PSH_ACK, MQTTLength);
 
     ipHeader *ip = (ipHeader*)ether->data;
     uint8_t ipHeaderLength = (ip->revSize & 0xF) * 4;
@@ -307,15 +380,16 @@ void mqttSendUnsubscribe(etherHeader *ether, char *topic)
     mqttUnsubscribe-> ID = htons(mqttID);
 
     mqttUnsubscribe->topicLength = htons(TopicLength);
-    for (i = 0; i < TopicLength; i++)
-        mqttUnsubscribe->topic[i] = topic[i];
+    etherSumWords(mqttUnsubscribe, 0x06, &sum);
+    etherCopySumWords(mqttUnsubscribe->topic, topic, TopicLength, 0x06, &sum);
 
-    etherCalcTcpChecksum(ether);
-    etherPutPacket(ether, sizeof(etherHeader) + IP_HEADER_LENGTH + TCP_HEADER_LENGTH + MQTTLength);
-    etherIncrementSeq(MQTTLength);
+    etherCalcTcpChecksumPartial(ether, sum);
+    if (!etherTcpSend(ether, MQTTLength))
+        return false;
 
     mqttID++;
 
+    return true;
 }
 
 //=====================================================================================================
@@ -323,10 +397,9 @@ void mqttSendUnsubscribe(etherHeader *ether, char *topic)
 void mqttSendPingReq(etherHeader *ether)
 {
     uint16_t MQTTLength = 0x02; //2bytes
+    uint32_t sum = 0;
 
-    etherBuildEtherHeader(ether, mqtt_dest_addr, 0x0800);
-    etherBuildIpHeader(ether, TCP_HEADER_LENGTH + MQTTLength, mqtt_dest_ip);
-    etherBuildTcpHeader(ether, PSH_ACK);
+    etherBuildTcpHeaders(ether, PSH_ACK, MQTTLength);
 
     ipHeader *ip = (ipHeader*)ether->data;
     uint8_t ipHeaderLength = (ip->revSize & 0xF) * 4;
@@ -335,18 +408,15 @@ void mqttSendPingReq(etherHeader *ether)
 
     mqttPingReq->typeFlags = PINGREQ | 0x0;
     mqttPingReq->remainingLength = MQTTLength - 0x02;
+    etherSumWords(mqttPingReq, MQTTLength, &sum);
 
-    etherCalcTcpChecksum(ether);
-    etherPutPacket(ether, sizeof(etherHeader) + IP_HEADER_LENGTH + TCP_HEADER_LENGTH + MQTTLength);
-    etherIncrementSeq(MQTTLength);
+    etherCalcTcpChecksumPartial(ether, sum);
+    etherTcpSend(ether, MQTTLength);
 }
 
-void MQTThandlePingResponse(etherHeader *ether)
+void MQTThandlePingResponse(uint8_t *packet)
 {
-    ipHeader *ip = (ipHeader*)ether->data;
-    uint8_t ipHeaderLength = (ip->revSize & 0xF) * 4;
-    tcpHeader *tcp = (tcpHeader*)((uint8_t*)ip + ipHeaderLength);
-    MQTTPingRespFrame *mqttPingResp = (MQTTPingRespFrame*)tcp->data;
+    MQTTPingRespFrame *mqttPingResp = (MQTTPingRespFrame*)packet;
 
     if (mqttPingResp->typeFlags == PINGRESP)
         handlePingResp();
@@ -355,12 +425,9 @@ void MQTThandlePingResponse(etherHeader *ether)
 
 //=====================================================================================================
 
-bool MQTThandleConnect(etherHeader *ether)
+bool MQTThandleConnect(uint8_t *packet)
 {
-    ipHeader *ip = (ipHeader*)ether->data;
-    uint8_t ipHeaderLength = (ip->revSize & 0xF) * 4;
-    tcpHeader *tcp = (tcpHeader*)((uint8_t*)ip + ipHeaderLength);
-    MQTTConnectAckFrame *mqttConnectAck = (MQTTConnectAckFrame*)tcp->data;
+    MQTTConnectAckFrame *mqttConnectAck = (MQTTConnectAckFrame*)packet;
 
     if ((mqttConnectAck->typeFlags & 0xF0) == CONNACK)
     {
@@ -386,3 +453,10 @@ bool MQTTisConnected()
     return connected;
 }
 
+// Marks the broker session as lost without a DISCONNECT, used when the link is lost
+void MQTTresetConnection()
+{
+    connected = false;
+    mqttSkip = 0;
+}
+
@@ -33,6 +33,10 @@
 #define MAX_TOPIC_LENGTH 128
 #define MAX_DATA_LENGTH 128
 
+// Largest received control packet handled, fixed header included
+// Bigger ones (e.g. publishes past the topic and data limits) are skipped
+#define MQTT_MAX_PACKET_SIZE 300
+
 // Control Packets Type
 typedef enum _mqtt_type
 {
@@ -183,21 +187,24 @@ typedef struct _MQTTUnsubscribeFrame
 void mqttSendConnect(etherHeader *ether, uint8_t *local_dest_addr, uint8_t *local_dest_ip, char * ID);
 void mqttSendConnectReturn(etherHeader *ether);
 bool MQTTisPacket(etherHeader *ether);
-uint8_t MQTTgetPacketLength(etherHeader *ether);
+
+void mqttHandleStream();
+void mqttHandlePacket(uint8_t *packet, uint8_t headerLength, uint16_t length);
 
 void mqttSendDisconnect(etherHeader *ether);
 
-void mqttSendPublish(etherHeader *ether, char *topic, char *data);
-void mqttHandlePublish(etherHeader *ether);
+bool mqttSendPublish(etherHeader *ether, char *topic, char *data);
+void mqttHandlePublish(uint8_t *packet, uint8_t headerLength, uint16_t length);
 
-void mqttSendSubscribe(etherHeader *ether, char *topic);
-void mqttSendUnsubscribe(etherHeader *ether, char *topic);
+bool mqttSendSubscribe(etherHeader *ether, char *topic);
+bool mqttSendUnsubscribe(etherHeader *ether, char *topic);
 
 void mqttSendPingReq(etherHeader *ether);
-void MQTThandlePingResponse(etherHeader *ether);
+void MQTThandlePingResponse(uint8_t *packet);
 
-bool MQTThandleConnect(etherHeader *ether);
+bool MQTThandleConnect(uint8_t *packet);
 bool MQTThandleDisconnect(etherHeader *ether);
+void MQTTresetConnection();
 bool MQTTisConnected(void);
 
 #endif /* MQTT_H_ */
@@ -0,0 +1,169 @@
+// Packet Classifier Library
+// IOT Project #1
+// Nathan Fusselman and Deborah Jahaj
+
+//=====================================================================================================
+// Device includes, defines, and assembler directives
+//=====================================================================================================
+
+#include "NETWORK/packet.h"
+#include "NETWORK/eth0.h"
+#include <stdint.h>
+#include <stdbool.h>
+#include "NETWORK/ip.h"
+#include "NETWORK/arp.h"
+#include "NETWORK/tcp.h"
+#include "NETWORK/udp.h"
+#include "main.h"
+
+#define ARP_LENGTH 28
+#define ICMP_HEADER_LENGTH 8
+#define UDP_HEADER_LENGTH 8
+
+// Handlers indexed by PACKET_TYPE, 0 drops the frame
+packetHandler packetHandlers[PACKET_TYPES];
+
+//=====================================================================================================
+
+// Parses a frame once, filling info with its type, header offsets, lengths, and which
+// checksums were verified
+// Returns true if the frame is for one of the handled types with valid checksums
+bool etherParsePacket(etherHeader *ether, uint16_t size, packetInfo *info)
+{
+    uint8_t ipAddress[IP_ADD_LENGTH];
+    ipHeader *ip = (ipHeader*)ether->data;
+    arpPacket *arp = (arpPacket*)ether->data;
+    uint32_t sum;
+    uint16_t tmp16;
+    uint8_t i;
+
+    info->ether = ether;
+    info->size = size;
+    info->frameType = ntohs(ether->frameType);
+    info->type = PACKET_OTHER;
+    info->ipChecksumOk = false;
+    info->l4ChecksumOk = false;
+    info->unicast = false;
+    info->protocol = 0;
+    info->ipHeaderLength = 0;
+    info->ipLength = 0;
+    info->l4 = 0;
+    info->l4Length = 0;
+    info->payload = 0;
+    info->payloadLength = 0;
+
+    if (size < sizeof(etherHeader))
+        return false;
+    etherGetIpAddress(ipAddress);
+
+    // ARP addressed to us
+    if (info->frameType == 0x0806)
+    {
+        if (size < sizeof(etherHeader) + ARP_LENGTH)
+            return false;
+        info->unicast = true;
+        for (i = 0; i < IP_ADD_LENGTH; i++)
+            info->unicast &= (arp->destIp[i] == ipAddress[i]);
+        if (!info->unicast)
+            return false;
+        if (arp->op == htons(1))
+            info->type = PACKET_ARP_REQUEST;
+        else if (arp->op == htons(2))
+            info->type = PACKET_ARP_RESPONSE;
+        return info->type != PACKET_OTHER;
+    }
+
+    if (info->frameType != 0x0800)
+        return false;
+
+    // IP header, lengths are checked against the frame before anything is summed
+    info->ipHeaderLength = (ip->revSize & 0xF) * 4;
+    info->ipLength = ntohs(ip->length);
+    if (info->ipHeaderLength < IP_HEADER_LENGTH || info->ipLength < info->ipHeaderLength
+        || info->ipLength > size - sizeof(etherHeader))
+        return false;
+    sum = 0;
+    etherSumWords(ip, info->ipHeaderLength, &sum);
+    info->ipChecksumOk = (getEtherChecksum(sum) == 0);
+    if (!info->ipChecksumOk)
+        return false;
+
+    info->unicast = true;
+    for (i = 0; i < IP_ADD_LENGTH; i++)
+        info->unicast &= (ip->destIp[i] == ipAddress[i]);
+    if (!info->unicast)
+        return false;
+
+    info->protocol = ip->protocol;
+    info->l4 = (uint8_t*)ip + info->ipHeaderLength;
+    info->l4Length = info->ipLength - info->ipHeaderLength;
+
+    switch (info->protocol)
+    {
+        case 0x01:
+            if (info->l4Length < ICMP_HEADER_LENGTH)
+                return false;
+            sum = 0;
+            etherSumWords(info->l4, info->l4Length, &sum);
+            info->l4ChecksumOk = (getEtherChecksum(sum) == 0);
+            info->payload = info->l4 + ICMP_HEADER_LENGTH;
+            info->payloadLength = info->l4Length - ICMP_HEADER_LENGTH;
+            info->type = PACKET_ICMP;
+            break;
+        case 0x06:
+            if (info->l4Length < TCP_HEADER_LENGTH)
+                return false;
+            tmp16 = (((tcpHeader*)info->l4)->dataOffset >> 4) * 4;
+            if (tmp16 < TCP_HEADER_LENGTH || tmp16 > info->l4Length)
+                return false;
+            // uses the pseudo-header sum cached for the connection
+            info->l4ChecksumOk = etherCheckTcpChecksum(ether);
+            info->payload = info->l4 + tmp16;
+            info->payloadLength = info->l4Length - tmp16;
+            info->type = PACKET_TCP;
+            break;
+        case 0x11:
+            tmp16 = ntohs(((udpHeader*)info->l4)->length);
+            if (info->l4Length < UDP_HEADER_LENGTH || tmp16 < UDP_HEADER_LENGTH || tmp16 > info->l4Length)
+                return false;
+            info->l4Length = tmp16;
+            // a zero checksum means the sender did not compute one
+            if (((udpHeader*)info->l4)->check == 0)
+                info->l4ChecksumOk = true;
+            else
+            {
+                sum = 0;
+                etherSumWords(ip->sourceIp, 8, &sum);
+                sum += (uint16_t)ip->protocol << 8;
+                sum += htons(tmp16);
+                etherSumWords(info->l4, tmp16, &sum);
+                info->l4ChecksumOk = (getEtherChecksum(sum) == 0);
+            }
+            info->payload = info->l4 + UDP_HEADER_LENGTH;
+            info->payloadLength = tmp16 - UDP_HEADER_LENGTH;
+            info->type = PACKET_UDP;
+            break;
+        default:
+            return false;
+    }
+    return info->l4ChecksumOk;
+}
+
+//=====================================================================================================
+
+// Registers the handler run by etherDispatchPacket for a packet type
+void etherSetPacketHandler(PACKET_TYPE type, packetHandler handler)
+{
+    if (type < PACKET_TYPES)
+        packetHandlers[type] = handler;
+}
+
+// Runs the handler for a parsed frame, returns false if none is registered
+bool etherDispatchPacket(packetInfo *info)
+{
+    packetHandler handler = packetHandlers[info->type];
+    if (handler == 0)
+        return false;
+    handler(info);
+    return true;
+}
@@ -0,0 +1,53 @@
+// Packet Classifier Library
+// IOT Project #1
+// Nathan Fusselman and Deborah Jahaj
+
+//=====================================================================================================
+// Device includes, defines, and assembler directives
+//=====================================================================================================
+
+#ifndef PACKET_H_
+#define PACKET_H_
+
+#include "NETWORK/eth0.h"
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef enum _packet_type
+{
+    PACKET_OTHER,
+    PACKET_ARP_REQUEST,
+    PACKET_ARP_RESPONSE,
+    PACKET_ICMP,
+    PACKET_TCP,
+    PACKET_UDP,
+    PACKET_TYPES
+} PACKET_TYPE;
+
+// Result of parsing a received frame once
+// Offsets and lengths are in host order, l4 and payload point into the frame
+typedef struct _packetInfo
+{
+    etherHeader *ether;
+    uint16_t size;
+    uint16_t frameType;
+    PACKET_TYPE type;
+    bool ipChecksumOk;      // ip header checksum verified
+    bool l4ChecksumOk;      // icmp, tcp, or udp checksum verified
+    bool unicast;           // ip destination or arp target is this host
+    uint8_t protocol;
+    uint8_t ipHeaderLength;
+    uint16_t ipLength;
+    uint8_t *l4;            // icmp, tcp, or udp header
+    uint16_t l4Length;
+    uint8_t *payload;       // data following the l4 header
+    uint16_t payloadLength;
+} packetInfo;
+
+typedef void (*packetHandler)(packetInfo *info);
+
+bool etherParsePacket(etherHeader *ether, uint16_t size, packetInfo *info);
+void etherSetPacketHandler(PACKET_TYPE type, packetHandler handler);
+bool etherDispatchPacket(packetInfo *info);
+
+#endif
@@ -30,16 +30,79 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
+#include <string.h>
 #include "NETWORK/ip.h"
 #include "NETWORK/mqtt.h"
+#include "SYSTEM/tick.h"
 #include "main.h"
 
+// RFC 6298 timers in ms
+#define TCP_RTO_INITIAL 1000
+#define TCP_RTO_MIN 200
+#define TCP_RTO_MAX 60000
+#define TCP_CLOCK_GRANULARITY 1
+#define TCP_MAX_RETRIES 8
+#define TCP_DUP_ACK_THRESHOLD 3
+
+// Delayed acks (RFC 1122), every second in-order segment or after TCP_ACK_DELAY ms
+#define TCP_ACK_SEGMENTS 2
+#define TCP_ACK_DELAY 100
+
+// Sequence comparisons modulo 2^32
+#define SEQ_LT(a, b) ((int32_t)((a) - (b)) < 0)
+#define SEQ_LEQ(a, b) ((int32_t)((a) - (b)) <= 0)
+#define SEQ_GT(a, b) ((int32_t)((a) - (b)) > 0)
+#define SEQ_GEQ(a, b) ((int32_t)((a) - (b)) >= 0)
+
 TCP_STATE currentTCPState = CLOSED;
 uint16_t source_port = 0, dest_port = 0;
 uint32_t seq = 0, ack = 0;
 uint8_t dest_addr[HW_ADD_LENGTH] = {2,3,4,5,6,7};
 uint8_t dest_ip[IP_ADD_LENGTH] = {0,0,0,0};
 
+// Pseudo-header sum of source ip, destination ip, and protocol for the connection
+// Only the segment length changes per packet
+uint32_t pseudoSum = 0;
+
+// Ethernet, ip, and tcp headers for the connection, built once when it is opened
+// Length, id, seq, ack, flags, and window are left zero and patched into each segment
+// templateIpCheck is the ip checksum and templateTcpSum the tcp header plus pseudo-header
+// sum with those fields zero, so both checksums are adjusted rather than recomputed
+uint8_t headerTemplate[sizeof(etherHeader) + IP_HEADER_LENGTH + TCP_HEADER_LENGTH];
+uint16_t templateIpCheck = 0;
+uint32_t templateTcpSum = 0;
+
+// Segments not yet acknowledged, oldest at rtxHead, those from sndNxt on are not sent yet
+// seq is the next sequence number handed to a new segment
+// sndUna is the oldest unacknowledged and sndNxt the next to transmit
+// sndWnd is the peer's window from sndUna, last updated by the segment at sndWl1/sndWl2
+tcpSegment rtxQueue[TCP_RTX_QUEUE_SIZE];
+uint8_t rtxHead = 0, rtxCount = 0;
+uint32_t sndUna = 0, sndNxt = 0;
+uint32_t sndWnd = 0, sndWl1 = 0, sndWl2 = 0;
+
+// Round trip estimate (Jacobson), rto includes any backoff and drops back to rtoBase on new acks
+// The timer runs for the oldest segment from rtxTimerStart
+bool rttValid = false;
+uint32_t srtt = 0, rttvar = 0;
+uint32_t rtoBase = TCP_RTO_INITIAL, rto = TCP_RTO_INITIAL;
+uint32_t rtxTimerStart = 0;
+uint8_t rtxRetries = 0, dupAcks = 0;
+bool fastRetransmit = false;
+
+// Receive stream ring, ack advances by what is appended here
+uint8_t rxStream[TCP_RX_BUFFER_SIZE];
+uint16_t rxStreamHead = 0, rxStreamCount = 0;
+
+// Sequence ranges [oooStart, oooEnd) received past a gap, sorted and not touching
+// Their payload already sits in the stream ring at its offset from ack
+uint32_t oooStart[TCP_OOO_RANGES], oooEnd[TCP_OOO_RANGES];
+uint8_t oooCount = 0;
+
+// In-order data segments received but not yet acked, anything sent carries the ack
+uint8_t ackPending = 0;
+uint32_t ackTimerStart = 0;
+
 //=====================================================================================================
 
 void etherBuildTcpHeader(etherHeader *ether, TCP_TYPE type)
@@ -57,6 +120,84 @@ void etherBuildTcpHeader(etherHeader *ether, TCP_TYPE type)
     tcp->windowSize = ntohs(0x05B4);
     tcp->checksum = 0x0;
     tcp->urgentPointer = 0x0;
+}
+
+// Builds the connection header template, pseudoSum must already be set
+void etherBuildHeaderTemplate()
+{
+    etherHeader *ether = (etherHeader*)headerTemplate;
+    ipHeader *ip = (ipHeader*)ether->data;
+    tcpHeader *tcp = (tcpHeader*)ip->data;
+    uint32_t sum = 0;
+
+    memset(headerTemplate, 0, sizeof(headerTemplate));
+    etherBuildEtherHeader(ether, dest_addr, 0x0800);
+
+    ip->revSize = 0x40 | (IP_HEADER_LENGTH / 4);
+    ip->flagsAndOffset = htons(0x4000);
+    ip->ttl = IP_TTL;
+    ip->protocol = 0x06;
+    etherGetIpAddress(ip->sourceIp);
+    memcpy(ip->destIp, dest_ip, IP_ADD_LENGTH);
+    etherSumWords(ip, IP_HEADER_LENGTH, &sum);
+    templateIpCheck = getEtherChecksum(sum);
+
+    tcp->sourcePort = htons(source_port);
+    tcp->destPort = htons(dest_port);
+    tcp->dataOffset = (TCP_HEADER_LENGTH / 4) << 4;
+    templateTcpSum = pseudoSum;
+    etherSumWords(tcp, TCP_HEADER_LENGTH, &templateTcpSum);
+}
+
+// Builds ethernet, ip, and tcp headers for a segment on the connection from the template
+// dataLength is the tcp payload length
+// The tcp checksum is left covering the headers only, finish it with
+// etherCalcTcpChecksumPartial once the payload sum is known (not needed if there is none)
+void etherBuildTcpHeaders(etherHeader *ether, TCP_TYPE type, uint16_t dataLength)
+{
+    etherBuildTcpHeadersAt(ether, type, seq, dataLength);
+}
+
+// As etherBuildTcpHeaders with an explicit sequence number, used to resend queued segments
+void etherBuildTcpHeadersAt(etherHeader *ether, TCP_TYPE type, uint32_t sequence, uint16_t dataLength)
+{
+    ipHeader *ip = (ipHeader*)ether->data;
+    tcpHeader *tcp = (tcpHeader*)ip->data;
+    uint32_t sum;
+
+    memcpy(ether, headerTemplate, sizeof(headerTemplate));
+
+    ip->length = htons(IP_HEADER_LENGTH + TCP_HEADER_LENGTH + dataLength);
+    ip->id = htons(etherNextIpId());
+    ip->headerChecksum = etherAdjustChecksum(templateIpCheck, 0, ip->length);
+    ip->headerChecksum = etherAdjustChecksum(ip->headerChecksum, 0, ip->id);
+
+    tcp->sequenceNumber = htonl(sequence);
+    tcp->acknowledgementNumber = htonl(ack);
+    tcp->controllBits = type;
+    tcp->windowSize = htons(etherTcpRecvWindow());
+
+    // flags share a word with the data offset and sit in its high lane
+    sum = templateTcpSum + htons(TCP_HEADER_LENGTH + dataLength);
+    etherSumWords(&tcp->sequenceNumber, 8, &sum);
+    sum += (uint16_t)type << 8;
+    sum += tcp->windowSize;
+    tcp->checksum = getEtherChecksum(sum);
+}
+
+// Builds the SYN for the connection with an mss option, sequence is the initial sequence number
+void etherBuildSyn(etherHeader *ether, uint32_t sequence)
+{
+    ipHeader *ip = (ipHeader*)ether->data;
+    tcpHeader *tcp = (tcpHeader*)ip->data;
+
+    etherBuildTcpHeadersAt(ether, SYN, sequence, 0x4);
+    tcp->dataOffset = ((TCP_HEADER_LENGTH + 0x4) / 4) << 4;
+
+    tcp->data[0] = 0x02;
+    tcp->data[1] = 0x04;
+    tcp->data[2] = 0x05;
+    tcp->data[3] = 0xB4;
 
     etherCalcTcpChecksum(ether);
 }
@@ -66,6 +207,7 @@ void etherBuildTcpHeader(etherHeader *ether, TCP_TYPE type)
 bool etherOpenTCPConnection(etherHeader *ether, uint8_t local_dest_addr[], uint8_t local_dest_ip[], uint16_t local_dest_port)
 {
     uint8_t i = 0;
+    uint8_t local_ip[IP_ADD_LENGTH];
 
     srand(time(NULL));
     seq = rand() % 0xFFFFFFFF;
@@ -78,32 +220,39 @@ bool etherOpenTCPConnection(etherHeader *ether, uint8_t local_dest_addr[], uint8
     for (i = 0; i < IP_ADD_LENGTH; i++)
             dest_ip[i] = local_dest_ip[i];
 
-    etherBuildEtherHeader(ether, dest_addr, 0x0800);
-    etherBuildIpHeader(ether, TCP_HEADER_LENGTH + 0x4, dest_ip);
-    etherBuildTcpHeader(ether, SYN);
-
-    ipHeader *ip = (ipHeader*)ether->data;
-    uint8_t ipHeaderLength = (ip->revSize & 0xF) * 4;
-    tcpHeader *tcp = (tcpHeader*)((uint8_t*)ip + ipHeaderLength);
-
-    tcp->dataOffset = ((TCP_HEADER_LENGTH + 0x4) / 4) << 4;
-
-    tcp->data[0] = 0x02;
-    tcp->data[1] = 0x04;
-    tcp->data[2] = 0x05;
-    tcp->data[3] = 0xB4;
-
-    etherCalcTcpChecksum(ether);
+    etherGetIpAddress(local_ip);
+    pseudoSum = 0;
+    etherSumWords(local_ip, IP_ADD_LENGTH, &pseudoSum);
+    etherSumWords(dest_ip, IP_ADD_LENGTH, &pseudoSum);
+    pseudoSum += htons(0x06);
+    etherBuildHeaderTemplate();
+
+    ack = 0;
+    sndUna = sndNxt = seq;
+    // only the SYN fits until the peer advertises a window
+    sndWnd = 1;
+    etherTcpClearRetransmit();
+    etherTcpStreamClear();
+    ackPending = 0;
+    rttValid = false;
+    rtoBase = rto = TCP_RTO_INITIAL;
 
     currentTCPState = SYN_SENT;
 
-    seq++;
-
-    etherPutPacket(ether, sizeof(etherHeader) + IP_HEADER_LENGTH + TCP_HEADER_LENGTH + 0x4);
+    etherBuildSyn(ether, seq);
+    etherTcpSend(ether, 0);
 
     return true;
 }
 
+// Drops the connection without sending anything, used when the link is lost
+void etherResetTCPConnection()
+{
+    currentTCPState = CLOSED;
+    etherTcpClearRetransmit();
+    ackPending = 0;
+}
+
 void etherHandleTCPPacket(etherHeader *ether)
 {
     if (currentTCPState == CLOSED)
@@ -111,13 +260,13 @@ void etherHandleTCPPacket(etherHeader *ether)
     ipHeader *ip = (ipHeader*)ether->data;
     uint8_t ipHeaderLength = (ip->revSize & 0xF) * 4;
     tcpHeader *tcp = (tcpHeader*)((uint8_t*)ip + ipHeaderLength);
+    uint16_t dataLength;
+    uint32_t segEnd;
+    bool immediate;
     bool ok;
+    // checksum is verified by etherParsePacket before dispatch
     ok = (ip->protocol == 0x06);
     if (ok)
-    {
-        ok = (etherCheckTcpChecksum(ether) == 0);
-    }
-    if (ok)
     {
         bool URG_BIT, ACK_BIT, PSH_BIT, RST_BIT, SYN_BIT, FIN_BIT;
 
@@ -128,63 +277,532 @@ void etherHandleTCPPacket(etherHeader *ether)
         SYN_BIT = tcp->controllBits & (1 << 1);
         FIN_BIT = tcp->controllBits & (1 << 0);
 
-        if (!URG_BIT && ACK_BIT && !PSH_BIT && !RST_BIT && !SYN_BIT && FIN_BIT)
+        dataLength = ntohs(ip->length) - ipHeaderLength - (tcp->dataOffset >> 4) * 4;
+        segEnd = ntohl(tcp->sequenceNumber) + dataLength;
+
+        if (ACK_BIT && !RST_BIT)
+            etherTcpProcessAck(tcp, dataLength);
+
+        // Payload goes to the stream, MQTT takes whole control packets from it
+        // In-order segments are acked every TCP_ACK_SEGMENTS or by the timer in etherTcpPoll,
+        // unless something MQTT sends meanwhile carries the ack
+        // A duplicate, one past a gap, or one filling a gap is acked at once, so the peer
+        // sees duplicate acks and fast retransmits the missing segment
+        if (ACK_BIT && !RST_BIT && !SYN_BIT && dataLength > 0 && currentTCPState == ESTABLISHED)
         {
-            ack++;
-            etherTcpAck(ether);
-            currentTCPState = CLOSED;
-            MQTThandleDisconnect(ether);
+            immediate = (oooCount > 0);
+            if (etherTcpReceiveData(tcp, dataLength))
+            {
+                if (ackPending++ == 0)
+                    ackTimerStart = getTick();
+                mqttHandleStream();
+            }
+            else
+                immediate = true;
+            if (ackPending >= TCP_ACK_SEGMENTS || oooCount > 0)
+                immediate = true;
+            if (immediate && !FIN_BIT)
+                etherTcpAck(ether);
+        }
+        if (!URG_BIT && ACK_BIT && !RST_BIT && !SYN_BIT && FIN_BIT)
+        {
+            // a fin past a gap is only acked, the peer resends it with the missing data
+            if (segEnd == ack)
+            {
+                ack++;
+                etherTcpAck(ether);
+                etherResetTCPConnection();
+                MQTThandleDisconnect(ether);
+            }
+            else
+                etherTcpAck(ether);
         }
         if (!URG_BIT && !ACK_BIT && !PSH_BIT && RST_BIT && !SYN_BIT && !FIN_BIT)
         {
             ack = ntohl(tcp->sequenceNumber) + 1;
             etherTcpAck(ether);
-            currentTCPState = CLOSED;
+            etherResetTCPConnection();
             MQTThandleDisconnect(ether);
         }
         if (!URG_BIT && ACK_BIT && !PSH_BIT && RST_BIT && !SYN_BIT && !FIN_BIT)
         {
             ack = ntohl(tcp->sequenceNumber) + 1;
             etherTcpAck(ether);
-            currentTCPState = CLOSED;
+            etherResetTCPConnection();
             MQTThandleDisconnect(ether);
         }
         if (!URG_BIT && !ACK_BIT && !PSH_BIT && !RST_BIT && SYN_BIT && !FIN_BIT)
         {}
-        if (!URG_BIT && ACK_BIT && PSH_BIT && !RST_BIT && !SYN_BIT && !FIN_BIT)
+        if (!URG_BIT && ACK_BIT && !PSH_BIT && !RST_BIT && !SYN_BIT && !FIN_BIT)
+        {}
+        if (!URG_BIT && ACK_BIT && !PSH_BIT && !RST_BIT && SYN_BIT && !FIN_BIT)
         {
-            if (currentTCPState == ESTABLISHED)
+            if (currentTCPState == SYN_SENT)
             {
-                MQTThandleConnect(ether);
-                MQTThandlePingResponse(ether);
-                mqttHandlePublish(ether);
-                ack += MQTTgetPacketLength(ether);
+                ack = ntohl(tcp->sequenceNumber) + 1;
+                currentTCPState = ESTABLISHED;
+                // the CONNECT that follows carries the ack, the timer covers it if that waits
+                ackPending = 1;
+                ackTimerStart = getTick();
+                mqttSendConnectReturn(ether);
+            }
+            // a resent SYN-ACK means our ack was lost, the queued CONNECT is already covered
+            else
                 etherTcpAck(ether);
+        }
+    }
+}
+
+void etherTcpAck(etherHeader *ether)
+{
+    // queued segments may be waiting on the window, acks carry the next sent sequence number
+    etherBuildTcpHeadersAt(ether, ACK, sndNxt, 0);
+
+    etherTcpSend(ether, 0);
+}
+
+//=====================================================================================================
+
+// Sends a segment built by etherBuildTcpHeaders (or etherBuildSyn) and advances seq past it
+// Segments that use sequence space are queued until acknowledged, and only go out now if
+// nothing is waiting ahead of them and they fit the peer's window, otherwise etherTcpPoll
+// sends them as acks open the window
+// Returns false, without sending, if a segment cannot be queued (see etherTcpCanSend)
+bool etherTcpSend(etherHeader *ether, uint16_t dataLength)
+{
+    ipHeader *ip = (ipHeader*)ether->data;
+    tcpHeader *tcp = (tcpHeader*)ip->data;
+    uint8_t flags = tcp->controllBits;
+    uint16_t seqLength = dataLength + ((flags & (SYN | FIN)) ? 1 : 0);
+    tcpSegment *segment;
+
+    if (seqLength == 0)
+    {
+        etherPutPacket(ether, sizeof(etherHeader) + ntohs(ip->length));
+        ackPending = 0;
+        return true;
+    }
+    if (!etherTcpCanSend(dataLength))
+        return false;
+
+    segment = &rtxQueue[(rtxHead + rtxCount) % TCP_RTX_QUEUE_SIZE];
+    segment->seq = seq;
+    segment->length = dataLength;
+    segment->flags = flags;
+    segment->sent = false;
+    segment->retransmitted = false;
+    memcpy(segment->data, (uint8_t*)tcp + (tcp->dataOffset >> 4) * 4, dataLength);
+    rtxCount++;
+    seq += seqLength;
+
+    // headers were built at seq, so the frame can go as is when it is next in line
+    if (segment->seq == sndNxt && etherTcpInWindow(segment))
+    {
+        if (sndNxt == sndUna)
+            rtxTimerStart = getTick();
+        segment->sent = true;
+        segment->sentTime = getTick();
+        sndNxt = seq;
+        etherPutPacket(ether, sizeof(etherHeader) + ntohs(ip->length));
+        ackPending = 0;
+    }
+    return true;
+}
+
+// Returns true if a segment with dataLength bytes of payload can be queued
+bool etherTcpCanSend(uint16_t dataLength)
+{
+    return (currentTCPState != CLOSED && rtxCount < TCP_RTX_QUEUE_SIZE && dataLength <= TCP_RTX_DATA_SIZE);
+}
+
+// Returns true if all of a queued segment lies within the peer's window
+bool etherTcpInWindow(tcpSegment *segment)
+{
+    uint32_t end = segment->seq + segment->length + ((segment->flags & (SYN | FIN)) ? 1 : 0);
+    return SEQ_LEQ(end, sndUna + sndWnd);
+}
+
+// Empties the retransmission queue and stops its timer
+void etherTcpClearRetransmit()
+{
+    rtxHead = 0;
+    rtxCount = 0;
+    rtxRetries = 0;
+    dupAcks = 0;
+    fastRetransmit = false;
+    rto = rtoBase;
+}
+
+// Folds a round trip sample in ms into srtt and rttvar and recomputes the rto (RFC 6298)
+void etherTcpUpdateRtt(uint32_t rtt)
+{
+    uint32_t delta;
+
+    if (!rttValid)
+    {
+        srtt = rtt;
+        rttvar = rtt / 2;
+        rttValid = true;
+    }
+    else
+    {
+        delta = (srtt > rtt) ? srtt - rtt : rtt - srtt;
+        rttvar = (3 * rttvar + delta) / 4;
+        srtt = (7 * srtt + rtt) / 8;
+    }
+
+    rtoBase = srtt + ((4 * rttvar > TCP_CLOCK_GRANULARITY) ? 4 * rttvar : TCP_CLOCK_GRANULARITY);
+    if (rtoBase < TCP_RTO_MIN)
+        rtoBase = TCP_RTO_MIN;
+    if (rtoBase > TCP_RTO_MAX)
+        rtoBase = TCP_RTO_MAX;
+}
+
+// Retires queued segments covered by the segment's ack, updates the send window,
+// and counts duplicate acks
+// Only segments sent once give rtt samples (Karn), a retransmitted one is ambiguous,
+// so the backed-off rto is kept until such a segment is acked
+// Duplicates are pure acks (no data, SYN, or FIN) that leave the ack and window unchanged
+void etherTcpProcessAck(tcpHeader *tcp, uint16_t dataLength)
+{
+    tcpSegment *segment;
+    uint32_t now = getTick();
+    uint32_t ackNum = ntohl(tcp->acknowledgementNumber);
+    uint32_t segSeq = ntohl(tcp->sequenceNumber);
+    uint32_t window = ntohs(tcp->windowSize);
+    uint32_t end;
+    bool duplicate;
+
+    // acks for data never sent are ignored, as are old ones
+    if (SEQ_GT(ackNum, sndNxt) || SEQ_LT(ackNum, sndUna))
+        return;
+
+    duplicate = (ackNum == sndUna && window == sndWnd && dataLength == 0
+                 && !(tcp->controllBits & (SYN | FIN)));
+
+    // RFC 793 window update, only from segments no older than the last one used
+    if ((tcp->controllBits & SYN) || SEQ_LT(sndWl1, segSeq) || (sndWl1 == segSeq && SEQ_LEQ(sndWl2, ackNum)))
+    {
+        sndWnd = window;
+        sndWl1 = segSeq;
+        sndWl2 = ackNum;
+    }
+
+    if (SEQ_GT(ackNum, sndUna))
+    {
+        while (rtxCount > 0)
+        {
+            segment = &rtxQueue[rtxHead];
+            end = segment->seq + segment->length + ((segment->flags & (SYN | FIN)) ? 1 : 0);
+            if (!segment->sent || SEQ_LT(ackNum, end))
+                break;
+            if (!segment->retransmitted)
+            {
+                etherTcpUpdateRtt(now - segment->sentTime);
+                rto = rtoBase;
             }
+            rtxHead = (rtxHead + 1) % TCP_RTX_QUEUE_SIZE;
+            rtxCount--;
         }
-        if (!URG_BIT && ACK_BIT && !PSH_BIT && !RST_BIT && !SYN_BIT && !FIN_BIT)
-        {}
-        if (!URG_BIT && ACK_BIT && !PSH_BIT && !RST_BIT && SYN_BIT && !FIN_BIT)
+        sndUna = ackNum;
+        rtxRetries = 0;
+        dupAcks = 0;
+        rtxTimerStart = now;
+    }
+    else if (duplicate && sndNxt != sndUna)
+    {
+        if (++dupAcks == TCP_DUP_ACK_THRESHOLD)
+            fastRetransmit = true;
+    }
+}
+
+// Sends a queued segment into ether with the current ack number, sent or not before
+void etherTcpTransmit(etherHeader *ether, tcpSegment *segment)
+{
+    ipHeader *ip = (ipHeader*)ether->data;
+    tcpHeader *tcp = (tcpHeader*)ip->data;
+    uint32_t sum = 0;
+
+    if (segment->flags & SYN)
+        etherBuildSyn(ether, segment->seq);
+    else
+    {
+        etherBuildTcpHeadersAt(ether, (TCP_TYPE)segment->flags, segment->seq, segment->length);
+        etherCopySumWords(tcp->data, segment->data, segment->length, 0, &sum);
+        etherCalcTcpChecksumPartial(ether, sum);
+    }
+
+    if (segment->sent)
+        segment->retransmitted = true;
+    segment->sent = true;
+    segment->sentTime = getTick();
+    etherPutPacket(ether, sizeof(etherHeader) + ntohs(ip->length));
+    ackPending = 0;
+}
+
+// Runs the tcp timers, call often with a scratch frame buffer
+void etherTcpPoll(etherHeader *ether)
+{
+    if (currentTCPState == CLOSED)
+        return;
+
+    etherTcpPollSend(ether);
+
+    // a delayed ack that nothing sent above carried goes out alone
+    if (ackPending > 0 && getTick() - ackTimerStart >= TCP_ACK_DELAY)
+        etherTcpAck(ether);
+}
+
+// Runs the retransmission timer and sends queued segments the window now allows
+// Fast retransmits are deferred to here so the received frame is not overwritten
+// On timeout the oldest segment is resent and the rto doubled, the connection
+// is dropped after TCP_MAX_RETRIES
+// While the oldest segment lies outside the peer's window the timer probes with it
+// instead, so a lost window update cannot stall the connection, probes are not retries
+void etherTcpPollSend(etherHeader *ether)
+{
+    uint32_t now = getTick();
+    tcpSegment *segment;
+    bool probe;
+    uint8_t i;
+
+    if (currentTCPState == CLOSED || rtxCount == 0)
+        return;
+
+    segment = &rtxQueue[rtxHead];
+    probe = !etherTcpInWindow(segment);
+
+    if (fastRetransmit)
+    {
+        fastRetransmit = false;
+        etherTcpTransmit(ether, segment);
+        rtxTimerStart = now;
+    }
+    else if ((sndNxt != sndUna || probe) && now - rtxTimerStart >= rto)
+    {
+        if (!probe && ++rtxRetries > TCP_MAX_RETRIES)
         {
-            ack = ntohl(tcp->sequenceNumber) + 1;
-            etherTcpAck(ether);
-            currentTCPState = ESTABLISHED;
-            mqttSendConnectReturn(ether);
+            putsUart0("TCP connection timed out\n");
+            etherResetTCPConnection();
+            MQTThandleDisconnect(ether);
+            return;
         }
+
+        rto = (rto * 2 > TCP_RTO_MAX) ? TCP_RTO_MAX : rto * 2;
+        if (!segment->sent)
+            sndNxt = segment->seq + segment->length + ((segment->flags & (SYN | FIN)) ? 1 : 0);
+        etherTcpTransmit(ether, segment);
+        rtxTimerStart = now;
+    }
+
+    // send whatever now fits, in order, sent segments are all ahead of unsent ones
+    for (i = 0; i < rtxCount; i++)
+    {
+        segment = &rtxQueue[(rtxHead + i) % TCP_RTX_QUEUE_SIZE];
+        if (segment->sent)
+            continue;
+        if (!etherTcpInWindow(segment))
+            break;
+        if (sndNxt == sndUna)
+            rtxTimerStart = now;
+        sndNxt = segment->seq + segment->length + ((segment->flags & (SYN | FIN)) ? 1 : 0);
+        etherTcpTransmit(ether, segment);
     }
 }
 
-void etherTcpAck(etherHeader *ether)
+//=====================================================================================================
+
+// Returns the receive window to advertise, the free space in the stream
+uint16_t etherTcpRecvWindow()
 {
-    etherBuildEtherHeader(ether, dest_addr, 0x0800);
-    etherBuildIpHeader(ether, TCP_HEADER_LENGTH, dest_ip);
-    etherBuildTcpHeader(ether, ACK);
+    return TCP_RX_BUFFER_SIZE - rxStreamCount;
+}
 
-    etherPutPacket(ether, sizeof(etherHeader) + IP_HEADER_LENGTH + TCP_HEADER_LENGTH);
+// Takes the payload of a received segment into the stream and advances ack by what fit
+// The leading part of a segment overlapping ack is skipped, a segment past ack is written
+// at its place in the free part of the stream and held until the gap before it fills
+// Returns true if the stream grew
+bool etherTcpReceiveData(tcpHeader *tcp, uint16_t dataLength)
+{
+    uint8_t *payload = (uint8_t*)tcp + (tcp->dataOffset >> 4) * 4;
+    uint32_t segSeq = ntohl(tcp->sequenceNumber);
+    uint32_t offset = ack - segSeq;
+    uint16_t taken;
+
+    if ((int32_t)offset < 0)
+    {
+        // out of order, kept if it starts inside the window
+        offset = segSeq - ack;
+        if (offset >= etherTcpRecvWindow())
+            return false;
+        taken = etherTcpStreamWriteAt(offset, payload, dataLength);
+        etherTcpAddOutOfOrder(segSeq, segSeq + taken);
+        return false;
+    }
+    if (offset >= dataLength)
+        return false;
+
+    taken = etherTcpStreamWrite(payload + offset, dataLength - offset);
+    ack += taken;
+    etherTcpMergeOutOfOrder();
+    return (taken > 0);
+}
+
+// Records [start, end) as held past ack, merging it with ranges it overlaps or touches
+// Returns false if the table is full and the range could not be kept
+bool etherTcpAddOutOfOrder(uint32_t start, uint32_t end)
+{
+    uint8_t i, j;
+
+    if (start == end)
+        return true;
+
+    for (i = 0; i < oooCount && SEQ_LT(oooStart[i], start); i++);
+
+    if (i > 0 && SEQ_GEQ(oooEnd[i - 1], start))
+    {
+        i--;
+        if (SEQ_GT(end, oooEnd[i]))
+            oooEnd[i] = end;
+    }
+    else if (i < oooCount && SEQ_LEQ(oooStart[i], end))
+    {
+        oooStart[i] = start;
+        if (SEQ_GT(end, oooEnd[i]))
+            oooEnd[i] = end;
+    }
+    else
+    {
+        if (oooCount == TCP_OOO_RANGES)
+            return false;
+        for (j = oooCount; j > i; j--)
+        {
+            oooStart[j] = oooStart[j - 1];
+            oooEnd[j] = oooEnd[j - 1];
+        }
+        oooStart[i] = start;
+        oooEnd[i] = end;
+        oooCount++;
+    }
+
+    // absorb following ranges the grown one now reaches
+    while (i + 1 < oooCount && SEQ_LEQ(oooStart[i + 1], oooEnd[i]))
+    {
+        if (SEQ_GT(oooEnd[i + 1], oooEnd[i]))
+            oooEnd[i] = oooEnd[i + 1];
+        for (j = i + 1; j + 1 < oooCount; j++)
+        {
+            oooStart[j] = oooStart[j + 1];
+            oooEnd[j] = oooEnd[j + 1];
+        }
+        oooCount--;
+    }
+    return true;
+}
+
+// Moves held ranges that ack has reached into the stream, advancing ack past them
+void etherTcpMergeOutOfOrder()
+{
+    uint8_t j;
+
+    while (oooCount > 0 && SEQ_LEQ(oooStart[0], ack))
+    {
+        if (SEQ_GT(oooEnd[0], ack))
+        {
+            rxStreamCount += oooEnd[0] - ack;
+            ack = oooEnd[0];
+        }
+        for (j = 0; j + 1 < oooCount; j++)
+        {
+            oooStart[j] = oooStart[j + 1];
+            oooEnd[j] = oooEnd[j + 1];
+        }
+        oooCount--;
+    }
+}
+
+// Appends up to size bytes to the stream, returns the number that fit
+uint16_t etherTcpStreamWrite(const uint8_t *data, uint16_t size)
+{
+    size = etherTcpStreamWriteAt(0, data, size);
+    rxStreamCount += size;
+    return size;
+}
+
+// Copies up to size bytes into the free part of the stream offset bytes past its end,
+// without adding them to it, returns the number that fit
+uint16_t etherTcpStreamWriteAt(uint16_t offset, const uint8_t *data, uint16_t size)
+{
+    uint16_t free = TCP_RX_BUFFER_SIZE - rxStreamCount;
+    uint16_t tail = (rxStreamHead + rxStreamCount + offset) % TCP_RX_BUFFER_SIZE;
+    uint16_t first;
+
+    if (offset >= free)
+        return 0;
+    if (size > free - offset)
+        size = free - offset;
+
+    first = TCP_RX_BUFFER_SIZE - tail;
+    if (first > size)
+        first = size;
+    memcpy(&rxStream[tail], data, first);
+    memcpy(rxStream, data + first, size - first);
+    return size;
+}
+
+// Returns the number of bytes waiting in the stream
+uint16_t etherTcpStreamAvailable()
+{
+    return rxStreamCount;
+}
+
+// Returns a waiting byte without consuming it, offset must be below etherTcpStreamAvailable
+uint8_t etherTcpStreamPeek(uint16_t offset)
+{
+    return rxStream[(rxStreamHead + offset) % TCP_RX_BUFFER_SIZE];
+}
+
+// Consumes up to size bytes from the stream, copying them to dest unless it is null
+// Returns the number consumed
+uint16_t etherTcpStreamRead(void *dest, uint16_t size)
+{
+    uint16_t first;
+
+    if (size > rxStreamCount)
+        size = rxStreamCount;
+
+    if (dest != NULL)
+    {
+        first = TCP_RX_BUFFER_SIZE - rxStreamHead;
+        if (first > size)
+            first = size;
+        memcpy(dest, &rxStream[rxStreamHead], first);
+        memcpy((uint8_t*)dest + first, rxStream, size - first);
+    }
+    rxStreamHead = (rxStreamHead + size) % TCP_RX_BUFFER_SIZE;
+    rxStreamCount -= size;
+    return size;
+}
+
+void etherTcpStreamClear()
+{
+    rxStreamHead = 0;
+    rxStreamCount = 0;
+    oooCount = 0;
 }
 
 //=====================================================================================================
 
+// Adds the tcp pseudo-header to sum using the sum cached for the connection
+// Addresses are not compared, a segment from another host fails its checksum
+// which is what the single connection wants anyway
+void etherSumTcpPseudoHeader(etherHeader *ether, uint32_t *sum)
+{
+    ipHeader *ip = (ipHeader*)ether->data;
+    uint16_t tcpHeaderLength = ntohs(ip->length) - IP_HEADER_LENGTH;
+    *sum += pseudoSum + htons(tcpHeaderLength);
+}
+
 void etherCalcTcpChecksum(etherHeader *ether)//(tcpHeader *tcp, ipHeader *ip)
 {
     ipHeader *ip = (ipHeader*)ether->data;
@@ -193,17 +811,24 @@ void etherCalcTcpChecksum(etherHeader *ether)//(tcpHeader *tcp, ipHeader *ip)
 
     uint16_t tcpHeaderLength = ntohs(ip->length) - IP_HEADER_LENGTH;
     uint32_t sum = 0;
-    // 32-bit sum over ip header
+    // 32-bit sum over pseudo-header
     tcp->checksum = 0;
+    etherSumTcpPseudoHeader(ether, &sum);
     etherSumWords(tcp, tcpHeaderLength, &sum);
-    etherSumWords(ip->sourceIp, 4, &sum);
-    etherSumWords(ip->destIp, 4, &sum);
-    uint16_t tmp = ip->protocol;
-    tmp = htons(tmp);
-    etherSumWords(&tmp, 2, &sum);
-    tmp = tcpHeaderLength;
-    tmp = htons(tmp);
-    etherSumWords(&tmp, 2, &sum);
+    tcp->checksum = getEtherChecksum(sum);
+}
+
+// Completes the tcp checksum of a segment built by etherBuildTcpHeaders
+// once its payload has been summed into dataSum, e.g. by etherCopySumWords as it was built
+// Header length is a multiple of 4, so payload lanes line up with the segment
+void etherCalcTcpChecksumPartial(etherHeader *ether, uint32_t dataSum)
+{
+    ipHeader *ip = (ipHeader*)ether->data;
+    uint8_t ipHeaderLength = (ip->revSize & 0xF) * 4;
+    tcpHeader *tcp = (tcpHeader*)((uint8_t*)ip + ipHeaderLength);
+    uint32_t sum = (uint16_t)~tcp->checksum;
+
+    sum += dataSum;
     tcp->checksum = getEtherChecksum(sum);
 }
 
@@ -215,17 +840,9 @@ bool etherCheckTcpChecksum(etherHeader *ether)    //(tcpHeader *tcp, ipHeader *i
 
     uint16_t tcpHeaderLength = ntohs(ip->length) - IP_HEADER_LENGTH;
     uint32_t sum = 0;
-    // 32-bit sum over ip header
-    tcp->checksum = 0;
+    // sum over the segment including its checksum, a valid segment folds to zero
     etherSumWords(tcp, tcpHeaderLength, &sum);
-    etherSumWords(ip->sourceIp, 4, &sum);
-    etherSumWords(ip->destIp, 4, &sum);
-    uint16_t tmp = ip->protocol;
-    tmp = htons(tmp);
-    etherSumWords(&tmp, 2, &sum);
-    tmp = tcpHeaderLength;
-    tmp = htons(tmp);
-    etherSumWords(&tmp, 2, &sum);
+    etherSumTcpPseudoHeader(ether, &sum);
     return (getEtherChecksum(sum) == 0);
 }
 
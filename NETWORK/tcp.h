@@ -33,6 +33,16 @@
 
 #define TCP_HEADER_LENGTH 20
 
+// Retransmission queue, sized for the largest MQTT packet this client builds
+#define TCP_RTX_QUEUE_SIZE 8
+#define TCP_RTX_DATA_SIZE 280
+
+// Receive stream, in-order payload waiting for the application, also the advertised window
+#define TCP_RX_BUFFER_SIZE 2048
+
+// Ranges of out-of-order payload held in the free part of the stream
+#define TCP_OOO_RANGES 4
+
 typedef enum _tcp_state
 {
     CLOSED,
@@ -74,14 +84,56 @@ typedef struct _tcpHeader       // 20 or more bytes
   uint8_t  data[0];
 } tcpHeader;
 
+// Segment kept until acknowledged, data is the payload only
+// Segments wait unsent while they are outside the peer's window
+typedef struct _tcpSegment
+{
+    uint32_t seq;
+    uint32_t sentTime;
+    uint16_t length;
+    uint8_t  flags;
+    bool     sent;
+    bool     retransmitted;
+    uint8_t  data[TCP_RTX_DATA_SIZE];
+} tcpSegment;
+
 void etherBuildTcpHeader(etherHeader *ether, TCP_TYPE type);
+void etherBuildHeaderTemplate(void);
+void etherBuildTcpHeaders(etherHeader *ether, TCP_TYPE type, uint16_t dataLength);
+void etherBuildTcpHeadersAt(etherHeader *ether, TCP_TYPE type, uint32_t sequence, uint16_t dataLength);
+void etherBuildSyn(etherHeader *ether, uint32_t sequence);
 
 bool etherOpenTCPConnection(etherHeader *ether, uint8_t dest_addr[], uint8_t dest_ip[], uint16_t dest_port);
 
+void etherResetTCPConnection();
+
 void etherHandleTCPPacket(etherHeader *ether);
 void etherTcpAck(etherHeader *ether);
 
+bool etherTcpSend(etherHeader *ether, uint16_t dataLength);
+bool etherTcpCanSend(uint16_t dataLength);
+void etherTcpClearRetransmit();
+void etherTcpUpdateRtt(uint32_t rtt);
+void etherTcpProcessAck(tcpHeader *tcp, uint16_t dataLength);
+bool etherTcpInWindow(tcpSegment *segment);
+void etherTcpTransmit(etherHeader *ether, tcpSegment *segment);
+void etherTcpPoll(etherHeader *ether);
+void etherTcpPollSend(etherHeader *ether);
+
+uint16_t etherTcpRecvWindow();
+bool etherTcpReceiveData(tcpHeader *tcp, uint16_t dataLength);
+bool etherTcpAddOutOfOrder(uint32_t start, uint32_t end);
+void etherTcpMergeOutOfOrder();
+uint16_t etherTcpStreamWrite(const uint8_t *data, uint16_t size);
+uint16_t etherTcpStreamWriteAt(uint16_t offset, const uint8_t *data, uint16_t size);
+uint16_t etherTcpStreamAvailable();
+uint8_t etherTcpStreamPeek(uint16_t offset);
+uint16_t etherTcpStreamRead(void *dest, uint16_t size);
+void etherTcpStreamClear();
+
+void etherSumTcpPseudoHeader(etherHeader *ether, uint32_t *sum);
 void etherCalcTcpChecksum(etherHeader *ether);
+void etherCalcTcpChecksumPartial(etherHeader *ether, uint32_t dataSum);
 bool etherCheckTcpChecksum(etherHeader *ether);
 
 uint32_t etherIncrementSeq(uint32_t num);
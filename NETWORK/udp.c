@@ -12,32 +12,6 @@
 #include "main.h"
 #include "NETWORK/udp.h"
 
-
-// Determines whether packet is UDP datagram
-// Must be an IP packet
-bool etherIsUdp(etherHeader *ether)
-{
-    ipHeader *ip = (ipHeader*)ether->data;
-    uint8_t ipHeaderLength = (ip->revSize & 0xF) * 4;
-    udpHeader *udp = (udpHeader*)((uint8_t*)ip + ipHeaderLength);
-    bool ok;
-    uint16_t tmp16;
-    uint32_t sum = 0;
-    ok = (ip->protocol == 0x11);
-    if (ok)
-    {
-        // 32-bit sum over pseudo-header
-        etherSumWords(ip->sourceIp, 8, &sum);
-        tmp16 = ip->protocol;
-        sum += (tmp16 & 0xff) << 8;
-        etherSumWords(&udp->length, 2, &sum);
-        // add udp header and data
-        etherSumWords(udp, ntohs(udp->length), &sum);
-        ok = (getEtherChecksum(sum) == 0);
-    }
-    return ok;
-}
-
 // Gets pointer to UDP payload of frame
 uint8_t * etherGetUdpData(etherHeader *ether)
 {
@@ -55,10 +29,10 @@ void etherSendUdpResponse(etherHeader *ether, uint8_t *udpData, uint8_t udpSize)
     ipHeader *ip = (ipHeader*)ether->data;
     uint8_t ipHeaderLength = (ip->revSize & 0xF) * 4;
     udpHeader *udp = (udpHeader*)((uint8_t*)ip + ipHeaderLength);
-    uint8_t *copyData;
     uint8_t i, tmp8;
     uint16_t tmp16;
     uint16_t udpLength;
+    uint16_t oldPort, oldLength;
     uint32_t sum = 0;
 
     // swap source and destination fields
@@ -78,21 +52,30 @@ void etherSendUdpResponse(etherHeader *ether, uint8_t *udpData, uint8_t udpSize)
     // dest port of resp will be left at source port of req
     // unusual nomenclature, but this allows a different tx
     // and rx port on other machine
+    oldPort = udp->sourcePort;
     udp->sourcePort = udp->destPort;
     // adjust lengths
     udpLength = 8 + udpSize;
+    oldLength = ip->length;
     ip->length = htons(ipHeaderLength + udpLength);
 
+    // the address swap leaves the ip header sum unchanged, only the length needs adjusting
+    ip->headerChecksum = etherAdjustChecksum(ip->headerChecksum, oldLength, ip->length);
 
-    // 32-bit sum over ip header
-    etherCalcIpChecksum(ether);//etherCalcIpChecksum(ip);
+    // echoing the payload in place only changes the source port
+    if (udp->check != 0 && udpData == udp->data && udpLength == ntohs(udp->length))
+    {
+        udp->check = etherAdjustChecksum(udp->check, oldPort, udp->sourcePort);
+        if (udp->check == 0)
+            udp->check = 0xFFFF;
+        etherPutPacket(ether, sizeof(etherHeader) + ipHeaderLength + udpLength);
+        return;
+    }
 
     // set udp length
     udp->length = htons(udpLength);
-    // copy data
-    copyData = udp->data;
-    for (i = 0; i < udpSize; i++)
-        copyData[i] = udpData[i];
+    // copy data, summing it on the way
+    etherCopySumWords(udp->data, udpData, udpSize, 8, &sum);
     // 32-bit sum over pseudo-header
     etherSumWords(ip->sourceIp, 8, &sum);
     tmp16 = ip->protocol;
@@ -100,7 +83,7 @@ void etherSendUdpResponse(etherHeader *ether, uint8_t *udpData, uint8_t udpSize)
     etherSumWords(&udp->length, 2, &sum);
     // add udp header
     udp->check = 0;
-    etherSumWords(udp, udpLength, &sum);
+    etherSumWords(udp, 8, &sum);
     udp->check = getEtherChecksum(sum);
 
     // send packet with size = ether + udp hdr + ip header + udp_size
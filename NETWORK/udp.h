@@ -22,7 +22,6 @@ typedef struct _udpHeader       // 8 bytes
   uint8_t  data[0];
 } udpHeader;
 
-bool etherIsUdp(etherHeader *ether);
 uint8_t* etherGetUdpData(etherHeader *ether);
 void etherSendUdpResponse(etherHeader *ether, uint8_t* udpData, uint8_t udpSize);
 
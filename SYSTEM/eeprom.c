@@ -48,11 +48,12 @@ uint32_t readEeprom(uint16_t add)
     return EEPROM_EERDWR_R;
 }
 
-// Clear static IP and MQTT IP address
+// Clear static IP, MQTT IP address, and SPI rate limit
 void clearEeprom()
 {
     writeEeprom(0, 0);
     writeEeprom(1, 0);
+    writeEeprom(2, 0);
 }
 
 
@@ -32,6 +32,9 @@
 #define SSI0FSS PORTA,3
 #define SSI0CLK PORTA,2
 
+// SSI0 has 8-entry tx and rx FIFOs
+#define SSI0_FIFO_DEPTH 8
+
 //-----------------------------------------------------------------------------
 // Global variables
 //-----------------------------------------------------------------------------
@@ -73,11 +76,18 @@ void initSpi0(uint32_t pinMask)
 }
 
 // Set baud rate as function of instruction cycle frequency
+// CPSDVSR must be even (2-254), so the divisor is rounded up to the next even value
+// and the resulting rate never exceeds baudRate
 void setSpi0BaudRate(uint32_t baudRate, uint32_t fcyc)
 {
-    uint32_t divisorTimes2 = (fcyc * 2) / baudRate;    // calculate divisor (r) times 2
+    uint32_t divisor = (fcyc + baudRate - 1) / baudRate;
+    divisor = (divisor + 1) & ~1;
+    if (divisor < 2)
+        divisor = 2;
+    if (divisor > 254)
+        divisor = 254;
     SSI0_CR1_R &= ~SSI_CR1_SSE;                        // turn off SSI to allow re-configuration
-    SSI0_CPSR_R = (divisorTimes2 + 1) >> 1;            // round divisor to nearest integer
+    SSI0_CPSR_R = divisor;
     SSI0_CR1_R |= SSI_CR1_SSE;                         // turn on SSI
 }
 
@@ -91,6 +101,14 @@ void setSpi0Mode(uint8_t polarity, uint8_t phase)
     SSI0_CR1_R |= SSI_CR1_SSE;                         // turn on SSI
 }
 
+// Set frame size, 4 to 16 bits
+void setSpi0DataSize(uint8_t bits)
+{
+    SSI0_CR1_R &= ~SSI_CR1_SSE;                        // turn off SSI to allow re-configuration
+    SSI0_CR0_R = (SSI0_CR0_R & ~SSI_CR0_DSS_M) | (bits - 1);
+    SSI0_CR1_R |= SSI_CR1_SSE;                         // turn on SSI
+}
+
 // Blocking function that writes data and waits until the tx buffer is empty
 void writeSpi0Data(uint32_t data)
 {
@@ -103,3 +121,39 @@ uint32_t readSpi0Data()
 {
     return SSI0_DR_R;
 }
+
+// Blocking function that writes a block of data, keeping the tx FIFO full
+// Rx data is drained as it arrives and discarded
+void writeSpi0Block(const uint8_t *data, uint16_t size)
+{
+    uint16_t tx = 0, rx = 0;
+    while (rx < size)
+    {
+        while ((tx < size) && ((tx - rx) < SSI0_FIFO_DEPTH) && (SSI0_SR_R & SSI_SR_TNF))
+            SSI0_DR_R = data[tx++];
+        while (SSI0_SR_R & SSI_SR_RNE)
+        {
+            SSI0_DR_R;
+            rx++;
+        }
+    }
+    while (SSI0_SR_R & SSI_SR_BSY);
+}
+
+// Blocking function that reads a block of data by clocking out zeros
+// Keeps the tx FIFO full and drains the rx FIFO in batches
+void readSpi0Block(uint8_t *data, uint16_t size)
+{
+    uint16_t tx = 0, rx = 0;
+    while (rx < size)
+    {
+        while ((tx < size) && ((tx - rx) < SSI0_FIFO_DEPTH) && (SSI0_SR_R & SSI_SR_TNF))
+        {
+            SSI0_DR_R = 0;
+            tx++;
+        }
+        while (SSI0_SR_R & SSI_SR_RNE)
+            data[rx++] = SSI0_DR_R;
+    }
+    while (SSI0_SR_R & SSI_SR_BSY);
+}
@@ -34,7 +34,10 @@
 void initSpi0(uint32_t pinMask);
 void setSpi0BaudRate(uint32_t clockRate, uint32_t fcyc);
 void setSpi0Mode(uint8_t polarity, uint8_t phase);
+void setSpi0DataSize(uint8_t bits);
 void writeSpi0Data(uint32_t data);
 uint32_t readSpi0Data();
+void writeSpi0Block(const uint8_t *data, uint16_t size);
+void readSpi0Block(uint8_t *data, uint16_t size);
 
 #endif
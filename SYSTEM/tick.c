@@ -0,0 +1,55 @@
+// Tick Library
+// IOT Project #1
+// Nathan Fusselman and Deborah Jahaj
+
+//-----------------------------------------------------------------------------
+// Hardware Target
+//-----------------------------------------------------------------------------
+
+// Target Platform: EK-TM4C123GXL
+// Target uC:       TM4C123GH6PM
+// System Clock:    40 MHz
+
+// Hardware configuration:
+// SysTick
+
+//-----------------------------------------------------------------------------
+// Device includes, defines, and assembler directives
+//-----------------------------------------------------------------------------
+
+#include <stdint.h>
+#include "tm4c123gh6pm.h"
+#include "SYSTEM/tick.h"
+
+// 1 ms at 40 MHz
+#define TICK_RELOAD (40000 - 1)
+
+//-----------------------------------------------------------------------------
+// Global variables
+//-----------------------------------------------------------------------------
+
+volatile uint32_t tickCount = 0;
+
+//-----------------------------------------------------------------------------
+// Subroutines
+//-----------------------------------------------------------------------------
+
+// Starts a 1 ms SysTick interrupt from the system clock
+void initTick()
+{
+    NVIC_ST_CTRL_R = 0;
+    NVIC_ST_RELOAD_R = TICK_RELOAD;
+    NVIC_ST_CURRENT_R = 0;
+    NVIC_ST_CTRL_R = NVIC_ST_CTRL_CLK_SRC | NVIC_ST_CTRL_INTEN | NVIC_ST_CTRL_ENABLE;
+}
+
+void tickIsr()
+{
+    tickCount++;
+}
+
+// Returns milliseconds since initTick, wraps after 49 days so compare differences
+uint32_t getTick()
+{
+    return tickCount;
+}
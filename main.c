@@ -67,6 +67,7 @@
 #include "NETWORK/arp.h"
 #include "NETWORK/icpm.h"
 #include "NETWORK/udp.h"
+#include "NETWORK/packet.h"
 #include "SYSTEM/wait.h"
 #include "NETWORK/eth0.h"
 #include "SYSTEM/eeprom.h"
@@ -112,6 +113,7 @@ void initHw()
 void rebootSystem(etherHeader *data)
 {
     disconnectMQTT(data);
+    etherFlushTx();
     NVIC_APINT_R = (0x05FA0000 | NVIC_APINT_SYSRESETREQ);
 }
 
@@ -150,6 +152,26 @@ void displayConnectionInfo()
         putsUart0("Link is up\n");
     else
         putsUart0("Link is down\n");
+
+    displaySpiRate();
+    displayRxStats();
+}
+
+void displaySpiRate()
+{
+    char str[40];
+    sprintf(str, "SPI: %lu Hz\n", (unsigned long)etherGetSpiRate());
+    putsUart0(str);
+}
+
+void displayRxStats()
+{
+    char str[60];
+    sprintf(str, "RX ring: %u/%u bytes, high water %u\n", etherGetRxOccupancy(), etherGetRxSize(), etherGetRxHighWater());
+    putsUart0(str);
+    sprintf(str, "RX overflows: %u\n", etherGetRxOverflowCount());
+    putsUart0(str);
+    setPinValue(RED_LED, 0);
 }
 
 void printIP(uint8_t * IP)
@@ -178,6 +200,17 @@ void printMAC(uint8_t * MAC)
     }
 }
 
+// Receive classifier for etherGetPacketFiltered, only sees the peeked headers
+// Keeps ARP and IP unicast to this node, everything else is dropped in the controller
+bool isPacketWanted(etherHeader *ether, uint16_t size)
+{
+    if (ether->frameType == htons(0x0806))
+        return true;
+    if (ether->frameType == htons(0x0800))
+        return etherIsIpUnicast(ether);
+    return false;
+}
+
 void printPublish(char* topic, char* data)
 {
     putsUart0("Received publish:\n");
@@ -220,6 +253,26 @@ void handlePingResp()
     putsUart0("PONG\n");
 }
 
+// Reconnect to the broker if we were connected, or trying to, when the link dropped
+void handleLinkUp(etherHeader *data)
+{
+    putsUart0("Link is up\n");
+    if (currentState == CONNECTING || currentState == CONNECTED)
+        connectMQTT(data);
+}
+
+// Nothing sent before the link dropped can be trusted, start over once it returns
+void handleLinkDown()
+{
+    putsUart0("Link is down\n");
+    etherResetTCPConnection();
+    MQTTresetConnection();
+    if (currentState == CONNECTED)
+        currentState = CONNECTING;
+    else if (currentState == DISCONNECTING)
+        currentState = IDLE;
+}
+
 //=====================================================================================================
 
 void readIPfromEeprom(uint16_t loc, uint8_t *ip)
@@ -258,6 +311,130 @@ void SetIPfromCommand(USER_DATA *serialData, uint8_t ip[IP_ADD_LENGTH], uint16_t
 
 
 
+//=====================================================================================================
+
+#ifdef CHECKSUM_BENCHMARK
+// Original one byte per iteration etherSumWords, kept as the reference
+void sumWordsBytewise(void* data, uint16_t sizeInBytes, uint32_t* sum)
+{
+    uint8_t* pData = (uint8_t*)data;
+    uint16_t i;
+    uint8_t phase = 0;
+    uint16_t data_temp;
+    for (i = 0; i < sizeInBytes; i++)
+    {
+        if (phase)
+        {
+            data_temp = *pData;
+            *sum += data_temp << 8;
+        }
+        else
+          *sum += *pData;
+        phase = 1 - phase;
+        pData++;
+    }
+}
+
+// Prints SysTick cycle counts for both routines at common packet sizes, aligned and odd
+void benchmarkChecksum()
+{
+    const uint16_t sizes[] = {20, 64, 576, 1500};
+    static uint8_t buffer[1504];
+    uint32_t sumA, sumB, start, cyclesA, cyclesB;
+    uint8_t i, offset;
+    uint16_t j;
+    char str[80];
+
+    for (j = 0; j < sizeof(buffer); j++)
+        buffer[j] = j * 151 + 29;
+
+    NVIC_ST_CTRL_R = 0;
+    NVIC_ST_RELOAD_R = NVIC_ST_RELOAD_M;
+    NVIC_ST_CURRENT_R = 0;
+    NVIC_ST_CTRL_R = NVIC_ST_CTRL_CLK_SRC | NVIC_ST_CTRL_ENABLE;
+
+    putsUart0("Checksum cycles (bytewise / word):\n");
+    for (offset = 0; offset < 2; offset++)
+    {
+        for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+        {
+            sumA = sumB = 0;
+            start = NVIC_ST_CURRENT_R;
+            sumWordsBytewise(buffer + offset, sizes[i], &sumA);
+            cyclesA = (start - NVIC_ST_CURRENT_R) & NVIC_ST_RELOAD_M;
+            start = NVIC_ST_CURRENT_R;
+            etherSumWords(buffer + offset, sizes[i], &sumB);
+            cyclesB = (start - NVIC_ST_CURRENT_R) & NVIC_ST_RELOAD_M;
+            sprintf(str, "  %4u bytes%s: %6lu / %6lu %s\n", sizes[i], offset ? " (odd)" : "      ",
+                    (unsigned long)cyclesA, (unsigned long)cyclesB,
+                    getEtherChecksum(sumA) == getEtherChecksum(sumB) ? "ok" : "MISMATCH");
+            putsUart0(str);
+        }
+    }
+
+    NVIC_ST_CTRL_R = 0;
+}
+#endif
+
+//=====================================================================================================
+
+// Protocol handlers, dispatched by etherDispatchPacket once a frame is parsed
+
+void handleArpResponse(packetInfo *info)
+{
+    uint8_t i;
+    uint8_t * localMacAddressMQTT;
+    if (currentState != CONNECTING)
+        return;
+    localMacAddressMQTT = etherParseArpResponse(info->ether);
+    for (i = 0; i < HW_ADD_LENGTH; i++)
+        macAddressMQTT[i] = localMacAddressMQTT[i];
+    mqttSendConnect(info->ether, macAddressMQTT, ipAddressMQTT, mqttClientID);
+}
+
+void handleArpRequest(packetInfo *info)
+{
+    etherSendArpResponse(info->ether);
+}
+
+void handleIcmp(packetInfo *info)
+{
+    // echo request
+    if (((icmpHeader*)info->l4)->type == 8)
+        etherSendPingResponse(info->ether);
+}
+
+void handleTcp(packetInfo *info)
+{
+    etherHandleTCPPacket(info->ether);
+}
+
+void handleUdp(packetInfo *info)
+{
+    if (strcmp((char*)info->payload, "on") == 0)
+        setPinValue(GREEN_LED, 1);
+    if (strcmp((char*)info->payload, "off") == 0)
+        setPinValue(GREEN_LED, 0);
+    etherSendUdpResponse(info->ether, (uint8_t*)"Received", 9);
+}
+
+void initPacketHandlers()
+{
+    etherSetPacketHandler(PACKET_ARP_REQUEST, handleArpRequest);
+    etherSetPacketHandler(PACKET_ARP_RESPONSE, handleArpResponse);
+    etherSetPacketHandler(PACKET_ICMP, handleIcmp);
+    etherSetPacketHandler(PACKET_TCP, handleTcp);
+    etherSetPacketHandler(PACKET_UDP, handleUdp);
+}
+
+// Handles one received frame, parsing it once and dispatching on its type
+void processPacket(etherHeader *data, uint16_t size)
+{
+    packetInfo info;
+    if (etherParsePacket(data, size, &info))
+        etherDispatchPacket(&info);
+}
+
 //=============================================================================================
 // Main
 //=============================================================================================
@@ -265,7 +442,8 @@ void SetIPfromCommand(USER_DATA *serialData, uint8_t ip[IP_ADD_LENGTH], uint16_t
 int main(void)
 {
     bool validCmd;
-    uint8_t* udpData;
+    uint8_t packetCount;
+    uint16_t size;
     uint8_t buffer[MAX_PACKET_SIZE];
     etherHeader *data = (etherHeader*) buffer;
 
@@ -275,11 +453,17 @@ int main(void)
     initEeprom();
     readIPfromEeprom(IP_EEPROM_ADD, ipAddressLocal);
     readIPfromEeprom(MQTT_EEPROM_ADD, ipAddressMQTT);
+    etherSetSpiRateLimit(readEeprom(SPI_EEPROM_ADD));
 
     initHw();
     initUart0();
     setUart0BaudRate(115200, 40e6);
 
+#ifdef CHECKSUM_BENCHMARK
+    benchmarkChecksum();
+#endif
+    initTick();
+
     // Init ethernet interface (eth0)
     putsUart0("\nStarting eth0\n");
     etherSetMacAddress(2, 3, 4, 5, 6, 114);
@@ -289,7 +473,8 @@ int main(void)
     etherSetIpAddress(ipAddressLocal[0], ipAddressLocal[1], ipAddressLocal[2], ipAddressLocal[3]);
     etherSetIpSubnetMask(255, 255, 255, 0);
     etherSetIpGatewayAddress(GATEWAY_IP);
-    etherInit(ETHER_UNICAST | ETHER_BROADCAST | ETHER_HALFDUPLEX);
+    initPacketHandlers();
+    etherInit(ETHER_UNICAST | ETHER_BROADCAST | ETHER_HALFDUPLEX | ETHER_FLOWCONTROL);
     waitMicrosecond(100000);
     displayConnectionInfo();
 
@@ -302,6 +487,9 @@ int main(void)
         SetIPfromStartup(&serialData, ipAddressLocal, IP_EEPROM_ADD);
         etherSetIpAddress(ipAddressLocal[0], ipAddressLocal[1], ipAddressLocal[2], ipAddressLocal[3]);
     }
+
+    // Only let ARP for our IP through the broadcast traffic
+    etherSetArpPatternFilter();
     if((ipAddressMQTT[0] == 0) && (ipAddressMQTT[1] == 0) && (ipAddressMQTT[2] == 0))
     {
         putsUart0("Missing MQTT IP address. Type IP address below:\n");
@@ -345,6 +533,7 @@ int main(void)
                 putsUart0("\tREBOOT\n");
                 putsUart0("\tSTATUS\n");
                 putsUart0("\tSET [IP/MQTT] [IP]\n");
+                putsUart0("\tSPI [MHZ]\n");
                 putsUart0("\tPUBLISH [TOPIC] [DATA]\n");
                 putsUart0("\tSUBSCRIBE [TOPIC]\n");
                 putsUart0("\tUNSUBSCRIBE [TOPIC]\n");
@@ -371,6 +560,7 @@ int main(void)
                 {
                     SetIPfromCommand(&serialData, ipAddressLocal, IP_EEPROM_ADD);
                     etherSetIpAddress(ipAddressLocal[0], ipAddressLocal[1], ipAddressLocal[2], ipAddressLocal[3]);
+                    etherSetArpPatternFilter();
                     putsUart0("*IP saved and set to: ");
                     etherGetIpAddress(ipAddressLocal);
                     printIP(ipAddressLocal);
@@ -405,7 +595,8 @@ int main(void)
                         dataName[i] = tempDataName[i];
                     dataName[i] = '\0';
 
-                    mqttSendPublish(data, topicName,dataName);
+                    if (!mqttSendPublish(data, topicName,dataName))
+                        putsUart0("***TCP send queue is full, try again***\n");
                 }
                 else
                     putsUart0("***An MQTT broker connection is required***\n");
@@ -415,7 +606,10 @@ int main(void)
             if (isCommand(&serialData, "SUBSCRIBE", 1))
             {
                 if (MQTTisConnected())
-                    mqttSendSubscribe(data, getFieldString(&serialData, 1));
+                {
+                    if (!mqttSendSubscribe(data, getFieldString(&serialData, 1)))
+                        putsUart0("***TCP send queue is full, try again***\n");
+                }
                 else
                     putsUart0("***An MQTT broker connection is required***\n");
 
@@ -424,7 +618,10 @@ int main(void)
             if (isCommand(&serialData, "UNSUBSCRIBE", 1))
             {
                 if (MQTTisConnected())
-                    mqttSendUnsubscribe(data, getFieldString(&serialData, 1));
+                {
+                    if (!mqttSendUnsubscribe(data, getFieldString(&serialData, 1)))
+                        putsUart0("***TCP send queue is full, try again***\n");
+                }
                 else
                     putsUart0("***An MQTT broker connection is required***\n");
 
@@ -467,6 +664,13 @@ int main(void)
 
                 validCmd = true;
             }
+            if (isCommand(&serialData, "SPI", 1))
+            {
+                // Limit is applied by etherInit, 0 lets it scale to the controller maximum
+                writeEeprom(SPI_EEPROM_ADD, getFieldInteger(&serialData, 1) * 1000000);
+                putsUart0("*SPI limit saved, applies after reboot\n");
+                validCmd = true;
+            }
             if (isCommand(&serialData, "CLEAR", 0))
             {
                 putsUart0("Clearing Eeeprom...\n");
@@ -492,60 +696,40 @@ int main(void)
         }
 
 
+        // Link change
+        if (etherIsLinkChanged())
+        {
+            if (etherIsLinkUp())
+                handleLinkUp(data);
+            else
+                handleLinkDown();
+        }
+
         // Packet processing
         if (etherIsDataAvailable())
         {
+            // Latch the red LED on overflow, STATUS reports the counts and clears it
             if (etherIsOverflow())
-            {
                 setPinValue(RED_LED, 1);
-                waitMicrosecond(100000);
-                setPinValue(RED_LED, 0);
-            }
-
-            // Get packet
-            etherGetPacket(data, MAX_PACKET_SIZE);
 
-            if (currentState == CONNECTING && etherIsArpResponse(data))
+            // Drain every pending frame back-to-back, up to RX_BUDGET per wakeup
+            packetCount = etherGetPacketCount();
+            if (packetCount > RX_BUDGET)
+                packetCount = RX_BUDGET;
+            while (packetCount-- > 0)
             {
-                uint8_t i;
-                uint8_t * localMacAddressMQTT = etherParseArpResponse(data);
-                for (i = 0; i < HW_ADD_LENGTH; i++)
-                    macAddressMQTT[i] = localMacAddressMQTT[i];
-                mqttSendConnect(data, macAddressMQTT, ipAddressMQTT, mqttClientID);
+                // Get packet, drop frames not addressed to us before copying them
+                size = etherGetPacketFiltered(data, MAX_PACKET_SIZE, isPacketWanted);
+                if (size != 0)
+                    processPacket(data, size);
             }
+        }
 
-            // Handle ARP request
-            if (etherIsArpRequest(data))
-            {
-                etherSendArpResponse(data);
-            }
+        // Flow control blocks further frames, so no wakeup may come to lift it
+        if (etherIsRxPaused())
+            etherUpdateRxOccupancy();
 
-            // Handle IP datagram
-            if (etherIsIp(data))
-            {
-            	if (etherIsIpUnicast(data))
-            	{
-            		// handle icmp ping request
-					if (etherIsPingRequest(data))
-					{
-					  etherSendPingResponse(data);
-					}
-
-					// Handle TCP
-					etherHandleTCPPacket(data);
-
-					// Process UDP datagram
-					if (etherIsUdp(data))
-					{
-						udpData = etherGetUdpData(data);
-						if (strcmp((char*)udpData, "on") == 0)
-			                setPinValue(GREEN_LED, 1);
-                        if (strcmp((char*)udpData, "off") == 0)
-			                setPinValue(GREEN_LED, 0);
-						etherSendUdpResponse(data, (uint8_t*)"Received", 9);
-					}
-                }
-            }
-        }
+        // Tcp timers: resends, queued sends, and delayed acks
+        etherTcpPoll(data);
     }
 }
@@ -16,7 +16,9 @@
 #include "NETWORK/tcp.h"
 #include "NETWORK/ip.h"
 #include "NETWORK/arp.h"
+#include "NETWORK/packet.h"
 #include "SYSTEM/wait.h"
+#include "SYSTEM/tick.h"
 #include "NETWORK/eth0.h"
 #include "SYSTEM/eeprom.h"
 #include "tm4c123gh6pm.h"
@@ -34,12 +36,19 @@ typedef enum _STATE
 // Max packet is calculated as:
 // Ether frame header (18) + Max MTU (1500) + CRC (4)
 #define MAX_PACKET_SIZE 1522
+
+// Max frames handled per receive wakeup before the uart is checked again
+#define RX_BUDGET 8
 #define IP_ADD_LENGTH 4
 #define HW_ADD_LENGTH 6
 #define GATEWAY_IP 192,168,1,1
 
 #define IP_EEPROM_ADD 0
 #define MQTT_EEPROM_ADD 1
+#define SPI_EEPROM_ADD 2
+
+// Uncomment to time etherSumWords against the original bytewise routine at startup
+//#define CHECKSUM_BENCHMARK
 
 //============================================================================================
 
@@ -47,15 +56,32 @@ void initHw();
 void rebootSystem(etherHeader *data);
 
 void displayConnectionInfo();
+void displaySpiRate();
+void displayRxStats();
 void printIP(uint8_t * IP);
 void printMAC(uint8_t * MAC);
+bool isPacketWanted(etherHeader *ether, uint16_t size);
 void printPublish(char* topic, char* data);
+void handleArpResponse(packetInfo *info);
+void handleArpRequest(packetInfo *info);
+void handleIcmp(packetInfo *info);
+void handleTcp(packetInfo *info);
+void handleUdp(packetInfo *info);
+void initPacketHandlers();
+void processPacket(etherHeader *data, uint16_t size);
+
+#ifdef CHECKSUM_BENCHMARK
+void sumWordsBytewise(void* data, uint16_t sizeInBytes, uint32_t* sum);
+void benchmarkChecksum();
+#endif
 
 void connectMQTT(etherHeader *data);
 void connectMQTTReturn();
 void disconnectMQTT(etherHeader *data);
 void disconnectMQTTReturn();
 void handlePingResp();
+void handleLinkUp(etherHeader *data);
+void handleLinkDown();
 
 void readIPfromEeprom(uint16_t loc, uint8_t *ip);
 void SetIPfromStartup(USER_DATA *serialData, uint8_t ip[IP_ADD_LENGTH], uint16_t eepromAdd);